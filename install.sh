@@ -39,7 +39,7 @@ echo "Node.js, pigpio, FFmpeg and eSpeak installation"
 apt install -y npm pigpio ffmpeg espeak
 
 echo "OpenCV, WiringPI, Socat and RTIMULib installation"
-apt install -y libopencv-dev wiringpi socat librtimulib-dev
+apt install -y libopencv-dev wiringpi socat librtimulib-dev libavcodec-dev libavutil-dev libswscale-dev
 
 echo "Cleaning"
 rm -rf $BASEDIR
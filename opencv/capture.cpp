@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "common.hpp"
+#include "loop.hpp"
+#include "capture.hpp"
+
+#define ALIGNUP(n, a) (((n) + (a) - 1) / (a) * (a))
+
+static bool rawToYuv(Grabber &grabber, cv::Mat &image) {
+ int width = grabber.width;
+ int height = grabber.height;
+ int size = width * height * 3 / 2;
+
+ image.create(height * 3 / 2, width, CV_8UC1);
+
+ if(grabber.raw.type() == CV_8UC3) {                         // Le pilote a ignoré YU12
+  cv::cvtColor(grabber.raw, image, cv::COLOR_BGR2YUV_I420);
+  return true;
+ }
+
+ if(grabber.raw.total() == size) {
+  memcpy(image.data, grabber.raw.data, size);
+  return true;
+ }
+
+ int stride = ALIGNUP(width, 32);                            // Plans alignés du pilote bcm2835-v4l2
+ int lines = ALIGNUP(height, 16);
+ if(grabber.raw.total() != stride * lines * 3 / 2) {
+  fprintf(stderr, "Unexpected YUV frame size %d\n", int(grabber.raw.total()));
+  return false;
+ }
+
+ const uchar *src = grabber.raw.data;
+ uchar *dst = image.data;
+ for(int i = 0; i < height; i++)
+  memcpy(dst + i * width, src + i * stride, width);
+ src += stride * lines;
+ dst += width * height;
+ for(int p = 0; p < 2; p++) {
+  for(int i = 0; i < height / 2; i++)
+   memcpy(dst + i * width / 2, src + i * stride / 2, width / 2);
+  src += stride * lines / 4;
+  dst += width * height / 4;
+ }
+
+ return true;
+}
+
+static int takeSlot(Grabber *grabber, int from, int to) {
+ for(int i = 0; i < NBFRAMES; i++) {
+  if(grabber->states[i] == from) {
+   grabber->states[i] = to;
+   return i;
+  }
+ }
+ return -1;
+}
+
+static void grabberThread(Grabber *grabber) {
+ fprintf(stderr, "Capture thread starting\n");
+ int failures = 0;
+
+ while(grabber->run) {
+  if(!grabber->capture->grab()) {
+   if(++failures == GRABFAILURESMAX) {
+    fprintf(stderr, "Error grabbing frames\n");
+    grabber->failed = true;
+    writeEvent(grabber->grabbed);                            // Réveille la boucle principale qui constate l'échec
+    break;
+   }
+   usleep(GRABRETRY * 1000);
+   continue;
+  }
+  failures = 0;
+  uint64_t timestamp = getTimeNs(CLOCK_MONOTONIC);
+
+  int slot;
+  {
+   std::lock_guard<std::mutex> lock(grabber->mutex);
+   grabber->captured++;
+   slot = takeSlot(grabber, FRAMEFREE, FRAMEFILLING);
+   if(slot == -1)
+    grabber->exhausted++;
+  }
+  if(slot == -1)
+   continue;
+
+  cv::Mat &frame = grabber->frames[slot];                    // Réutilise le tampon déjà alloué
+  bool ok;
+  if(grabber->yuv)
+   ok = grabber->capture->retrieve(grabber->raw) && rawToYuv(*grabber, frame);
+  else
+   ok = grabber->capture->retrieve(frame);
+
+  {
+   std::lock_guard<std::mutex> lock(grabber->mutex);
+   if(ok) {
+    int old = takeSlot(grabber, FRAMEREADY, FRAMEFREE);
+    if(old != -1)
+     grabber->dropped++;
+    grabber->states[slot] = FRAMEREADY;
+    grabber->timestamps[slot] = timestamp;
+   } else
+    grabber->states[slot] = FRAMEFREE;
+  }
+
+  if(ok)
+   writeEvent(grabber->grabbed);
+ }
+
+ fprintf(stderr, "Capture thread stopping\n");
+}
+
+void startGrabber(Grabber &grabber, cv::VideoCapture &capture, bool yuv) {
+ grabber.yuv = yuv;
+ grabber.width = capture.get(cv::CAP_PROP_FRAME_WIDTH);
+ grabber.height = capture.get(cv::CAP_PROP_FRAME_HEIGHT);
+ if(yuv) {
+  capture.set(cv::CAP_PROP_FOURCC, cv::VideoWriter::fourcc('Y', 'U', '1', '2'));
+  capture.set(cv::CAP_PROP_CONVERT_RGB, 0);
+ }
+
+ for(int i = 0; i < NBFRAMES; i++) {                         // Pas d'allocation pendant la capture
+  if(yuv)
+   grabber.frames[i].create(grabber.height * 3 / 2, grabber.width, CV_8UC1);
+  else
+   grabber.frames[i].create(grabber.height, grabber.width, CV_8UC3);
+  grabber.states[i] = FRAMEFREE;
+ }
+ grabber.busy = -1;
+ grabber.start = getTimeNs(CLOCK_MONOTONIC);
+ grabber.captured = 0;
+ grabber.processed = 0;
+ grabber.dropped = 0;
+ grabber.exhausted = 0;
+ grabber.latency = 0;
+ grabber.latencyMax = 0;
+
+ grabber.capture = &capture;
+ grabber.grabbed = createEvent(true);
+ grabber.run = true;
+ grabber.failed = false;
+ grabber.thread = std::thread(grabberThread, &grabber);
+}
+
+bool retrieveFrame(Grabber &grabber, cv::Mat &image) {
+ readEvent(grabber.grabbed);
+
+ std::lock_guard<std::mutex> lock(grabber.mutex);
+ if(grabber.busy != -1)                                      // Oubli de releaseFrame()
+  grabber.states[grabber.busy] = FRAMEFREE;
+
+ grabber.busy = takeSlot(&grabber, FRAMEREADY, FRAMEBUSY);
+ if(grabber.busy == -1)
+  return false;
+
+ image = grabber.frames[grabber.busy];
+ return true;
+}
+
+void releaseFrame(Grabber &grabber) {
+ uint64_t now = getTimeNs(CLOCK_MONOTONIC);
+
+ std::lock_guard<std::mutex> lock(grabber.mutex);
+ if(grabber.busy == -1)
+  return;
+
+ uint64_t latency = now - grabber.timestamps[grabber.busy];  // De la saisie à la sortie de l'image
+ grabber.states[grabber.busy] = FRAMEFREE;
+ grabber.busy = -1;
+
+ grabber.processed++;
+ grabber.latency += latency;
+ if(latency > grabber.latencyMax)
+  grabber.latencyMax = latency;
+
+ if(now - grabber.start >= CAPTURESTATSPERIOD * 1000000000ULL) {
+  fprintf(stderr, "Capture %u frames %u processed %u dropped %u exhausted %llu us average latency %llu us max latency\n",
+                  grabber.captured, grabber.processed, grabber.dropped, grabber.exhausted,
+                  (unsigned long long) (grabber.latency / 1000 / grabber.processed),
+                  (unsigned long long) (grabber.latencyMax / 1000));
+  grabber.start = now;
+  grabber.captured = 0;
+  grabber.processed = 0;
+  grabber.dropped = 0;
+  grabber.exhausted = 0;
+  grabber.latency = 0;
+  grabber.latencyMax = 0;
+ }
+}
+
+void stopGrabber(Grabber &grabber) {
+ grabber.run = false;
+ grabber.thread.join();
+}
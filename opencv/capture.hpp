@@ -0,0 +1,46 @@
+#include <stdint.h>
+#include <thread>
+#include <mutex>
+#include <opencv2/opencv.hpp>
+#include <opencv2/videoio.hpp>
+
+#define NBFRAMES 3                                           // Une traitée, une prête, une en cours de saisie
+#define CAPTURESTATSPERIOD 10
+#define GRABRETRY 10 // Milliseconds
+#define GRABFAILURESMAX 100                                  // Échecs consécutifs au-delà desquels la caméra est abandonnée
+
+enum {
+ FRAMEFREE,
+ FRAMEFILLING,
+ FRAMEREADY,
+ FRAMEBUSY
+};
+
+typedef struct Grabber {
+ cv::VideoCapture *capture;
+ int grabbed;                                                // Une image est prête à être traitée
+ volatile bool run;
+ volatile bool failed;                                       // Plus aucune image ne sera saisie
+ std::thread thread;
+ bool yuv;
+ int width;
+ int height;
+ cv::Mat raw;
+ std::mutex mutex;
+ cv::Mat frames[NBFRAMES];
+ uint8_t states[NBFRAMES];
+ uint64_t timestamps[NBFRAMES];
+ int busy;
+ uint64_t start;
+ uint32_t captured;
+ uint32_t processed;
+ uint32_t dropped;                                           // Prête mais remplacée par une plus récente
+ uint32_t exhausted;                                         // Aucune place libre, image saisie perdue
+ uint64_t latency;
+ uint64_t latencyMax;
+} Grabber;
+
+void startGrabber(Grabber &grabber, cv::VideoCapture &capture, bool yuv);
+bool retrieveFrame(Grabber &grabber, cv::Mat &image);
+void releaseFrame(Grabber &grabber);
+void stopGrabber(Grabber &grabber);
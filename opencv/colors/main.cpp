@@ -1,11 +1,16 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <signal.h>
 #include <opencv2/opencv.hpp>
 #include <opencv2/videoio.hpp>
 #include <wiringSerial.h>
 #include "../common.hpp"
 #include "../frame.hpp"
+#include "../loop.hpp"
+#include "../capture.hpp"
+#include "../output.hpp"
+#include "../draw.hpp"
 #include "main.hpp"
 
 using namespace std;
@@ -52,12 +57,12 @@ void autopilot(Mat &image, bool enabled) {
    return;
 
   vector<vector<Point>> polygon(1, features[id].polygon);
-  drawContours(image, polygon, -1, hueToBgr[colorToHue[features[id].color]], 2, LINE_AA);
+  drawPolygons(image, polygon, hueToBgr[colorToHue[features[id].color]], 2, LINE_AA, yuv);
 
   char text[80];
   sprintf(text, "Ready %s %d", COLORS[features[id].color], features[id].circleRadius);
-  putText(image, text, Point(5, 15), FONT_HERSHEY_PLAIN, 1.0, Scalar::all(0), 1);
-  putText(image, text, Point(6, 16), FONT_HERSHEY_PLAIN, 1.0, Scalar::all(255), 1);
+  drawText(image, text, Point(5, 15), FONT_HERSHEY_PLAIN, 1.0, Scalar::all(0), 1, yuv);
+  drawText(image, text, Point(6, 16), FONT_HERSHEY_PLAIN, 1.0, Scalar::all(255), 1, yuv);
 
   oldFeature = features[id];
   circleRadiusInit = features[id].circleRadius;
@@ -115,19 +120,19 @@ void autopilot(Mat &image, bool enabled) {
   autovz = constrain(-autovz, -127, 127);
 
   vector<vector<Point>> polygon(1, features[id].polygon);
-  drawContours(image, polygon, -1, hueToBgr[colorToHue[features[id].color]], 2, LINE_AA);
+  drawPolygons(image, polygon, hueToBgr[colorToHue[features[id].color]], 2, LINE_AA, yuv);
 
   char text[80];
   sprintf(text, "Tracking %s %d", COLORS[features[id].color], features[id].circleRadius);
-  putText(image, text, Point(5, 15), FONT_HERSHEY_PLAIN, 1.0, Scalar::all(0), 1);
-  putText(image, text, Point(6, 16), FONT_HERSHEY_PLAIN, 1.0, Scalar::all(255), 1);
+  drawText(image, text, Point(5, 15), FONT_HERSHEY_PLAIN, 1.0, Scalar::all(0), 1, yuv);
+  drawText(image, text, Point(6, 16), FONT_HERSHEY_PLAIN, 1.0, Scalar::all(255), 1, yuv);
 
   timeout = TIMEOUT;
  } else {
   char text[80];
   sprintf(text, "Waiting %d %s %d", timeout, COLORS[oldFeature.color], circleRadiusInit);
-  putText(image, text, Point(5, 15), FONT_HERSHEY_PLAIN, 1.0, Scalar::all(0), 1);
-  putText(image, text, Point(6, 16), FONT_HERSHEY_PLAIN, 1.0, Scalar::all(255), 1);
+  drawText(image, text, Point(5, 15), FONT_HERSHEY_PLAIN, 1.0, Scalar::all(0), 1, yuv);
+  drawText(image, text, Point(6, 16), FONT_HERSHEY_PLAIN, 1.0, Scalar::all(255), 1, yuv);
  }
 
 #ifdef HEADPAN
@@ -184,7 +189,23 @@ void colorsEngine(Mat &image, uchar &threshold) {
  Mat imageHsv;
  Mat imageMasks[NBCOLORS];
 
- resize(image, imageBgr, Size(width / BINNING, height / BINNING), INTER_LINEAR);
+ if(yuv) {                                                   // Les plans U et V sont déjà à la demi-résolution
+  Mat y, u, v;
+  yuvPlanes(image, y, u, v);
+
+  Mat planes[3];                                             // Plage limitée étendue à la pleine plage attendue par COLOR_YCrCb2BGR
+  resize(y, planes[0], u.size(), INTER_LINEAR);
+  planes[0].convertTo(planes[0], -1, 255.0 / YUVLUMARANGE, -YUVBLACK * 255.0 / YUVLUMARANGE);
+  v.convertTo(planes[1], -1, 255.0 / YUVCHROMARANGE, YUVNEUTRAL - YUVNEUTRAL * 255.0 / YUVCHROMARANGE);
+  u.convertTo(planes[2], -1, 255.0 / YUVCHROMARANGE, YUVNEUTRAL - YUVNEUTRAL * 255.0 / YUVCHROMARANGE);
+
+  Mat imageYcrcb;
+  merge(planes, 3, imageYcrcb);
+  cvtColor(imageYcrcb, imageBgr, COLOR_YCrCb2BGR);
+  if(BINNING != 2)
+   resize(imageBgr, imageBgr, Size(width / BINNING, height / BINNING), INTER_LINEAR);
+ } else
+  resize(image, imageBgr, Size(width / BINNING, height / BINNING), INTER_LINEAR);
  cvtColor(imageBgr, imageHsv, COLOR_BGR2HSV);
 
  for(int i = 0; i < NBCOLORS; i++)
@@ -398,15 +419,15 @@ bool ui(Mat &image, uchar &threshold) {
    Size textSize = getTextSize(text, FONT_HERSHEY_PLAIN, s, 1, &baseline);
    Point2f textCenter = Point(-textSize.width / 2, textSize.height / 2);
 
-   putText(image, text, features[i].center + textCenter, FONT_HERSHEY_PLAIN, s, Scalar::all(0), 1);
-   putText(image, text, features[i].center + textCenter + Point2f(1.0, 1.0), FONT_HERSHEY_PLAIN, s, Scalar::all(255), 1);
+   drawText(image, text, features[i].center + textCenter, FONT_HERSHEY_PLAIN, s, Scalar::all(0), 1, yuv);
+   drawText(image, text, features[i].center + textCenter + Point2f(1.0, 1.0), FONT_HERSHEY_PLAIN, s, Scalar::all(255), 1, yuv);
   }
 
  } else if(select >= SELECTCONFTHRESHOLD) {
-  image = Mat::zeros(image.size(), image.type());
+  clearImage(image, yuv);
   for(int i = 0; i < features.size(); i++) {
    vector<vector<Point>> polygon(1, features[i].polygon);
-   drawContours(image, polygon, -1, hueToBgr[colorToHue[features[i].color]], FILLED, LINE_AA);
+   drawPolygons(image, polygon, hueToBgr[colorToHue[features[i].color]], FILLED, LINE_AA, yuv);
   }
 
   char text[80];
@@ -417,22 +438,22 @@ bool ui(Mat &image, uchar &threshold) {
                              COLORS[(selectedColor + 1) % NBCOLORS],
                              hues[selectedColor]);
 
-  putText(image, text, Point(5, height - 35), FONT_HERSHEY_PLAIN, 1.0, Scalar::all(0), 1 + tune);
-  putText(image, text, Point(6, height - 34), FONT_HERSHEY_PLAIN, 1.0, Scalar::all(255), 1 + tune);
+  drawText(image, text, Point(5, height - 35), FONT_HERSHEY_PLAIN, 1.0, Scalar::all(0), 1 + tune, yuv);
+  drawText(image, text, Point(6, height - 34), FONT_HERSHEY_PLAIN, 1.0, Scalar::all(255), 1 + tune, yuv);
 
   uchar oldHue = 0;
   for(int i = 0; i < 180; i++) {
    int x = i * width / 180;
    if(!blacks[hueToColor[i]])
-    rectangle(image, Rect(x, height - 20, width / 180 + 1, 10), hueToBgr[colorToHue[hueToColor[i]]], FILLED);
-   rectangle(image, Rect(x, height - 10, width / 180 + 1, 10), hueToBgr[i], FILLED);
+    drawRectangle(image, Rect(x, height - 20, width / 180 + 1, 10), hueToBgr[colorToHue[hueToColor[i]]], FILLED, yuv);
+   drawRectangle(image, Rect(x, height - 10, width / 180 + 1, 10), hueToBgr[i], FILLED, yuv);
    if(hueToColor[i] != oldHue) {
     if(oldHue == selectedColor)
-     circle(image, Point(x, height - 25), 3 + tune, Scalar::all(255), FILLED, LINE_AA);
-    line(image, Point(x, height - 20), Point(x, height - 11), Scalar::all(0), 1);
+     drawCircle(image, Point(x, height - 25), 3 + tune, Scalar::all(255), FILLED, LINE_AA, yuv);
+    drawLine(image, Point(x, height - 20), Point(x, height - 11), Scalar::all(0), 1, LINE_8, yuv);
    }
    if(!((i + 7) % 15))
-    line(image, Point(x, height - 10), Point(x, height), Scalar::all(0), 1);
+    drawLine(image, Point(x, height - 10), Point(x, height), Scalar::all(0), 1, LINE_8, yuv);
    oldHue = hueToColor[i];
   }
  }
@@ -445,14 +466,41 @@ int main(int argc, char* argv[]) {
 
  signal(SIGTERM, signal_callback_handler);
 
- if(argc != 4) {
+ int outputMode = OUTPUTPIPE;
+ EncoderSettings encoderSettings = {0, ENCODERBITRATE, ENCODERKEYFRAMES};
+ int opt;
+ while((opt = getopt(argc, argv, "yse:b:g:")) != -1) {
+  switch(opt) {
+   case 'y':
+    yuv = true;
+    break;
+   case 's':
+    outputMode = OUTPUTSHM;
+    break;
+   case 'e':
+    outputMode = OUTPUTH264;
+    sscanf(optarg, "%d", &encoderSettings.port);
+    break;
+   case 'b':
+    sscanf(optarg, "%d", &encoderSettings.bitrate);
+    break;
+   case 'g':
+    sscanf(optarg, "%d", &encoderSettings.keyframes);
+    break;
+   default:
+    fprintf(stderr, "Usage: %s [-y] [-s | -e port [-b bitrate] [-g keyframes]] [width height fps]\n", argv[0]);
+    return 1;
+  }
+ }
+
+ if(argc - optind != 3) {
   width = WIDTH;
   height = HEIGHT;
   fps = FPS;
  } else {
-  sscanf(argv[1], "%d", &width);
-  sscanf(argv[2], "%d", &height);
-  sscanf(argv[3], "%d", &fps);
+  sscanf(argv[optind], "%d", &width);
+  sscanf(argv[optind + 1], "%d", &height);
+  sscanf(argv[optind + 2], "%d", &fps);
  }
 
  int fd = serialOpen(SERIALPORT, SERIALRATE);
@@ -462,7 +510,6 @@ int main(int argc, char* argv[]) {
  }
 
  Mat image;
- int size = width * height * 3;
  uchar threshold = THRESHOLD;
 
  telemetryFrame.header[0] = '$';
@@ -487,32 +534,65 @@ int main(int argc, char* argv[]) {
   return 1;
  }
 
+ Output output;
+ if(!openOutput(output, outputMode, stdout, encoderSettings, width, height, fps, yuv))
+  return 1;
+
+ Grabber grabber;
+ startGrabber(grabber, capture, yuv);
+
+ ModemLink modemLink = {};
+
+ int epfd = createLoop();
+ addToLoop(epfd, fd, EVENTMODEM);
+ addToLoop(epfd, grabber.grabbed, EVENTCAPTURE);
+
  while(run) {
-  capture.read(image);
+  int ids[NBEVENTSMAX];
+  int n = waitLoop(epfd, ids, LOOPTIMEOUT);
 
-  bool updated = readModem(fd, remoteFrame);
+  for(int i = 0; i < n; i++) {
+   switch(ids[i]) {
 
-  colorsEngine(image, threshold);
+    case EVENTMODEM:
+     if(readModem(fd, modemLink, remoteFrame)) {
+      for(int j = 1; j < NBCOMMANDS; j++) {
+       telemetryFrame.xy[j][0] = remoteFrame.xy[j][0];
+       telemetryFrame.xy[j][1] = remoteFrame.xy[j][1];
+      }
+      telemetryFrame.z = remoteFrame.z;
+      telemetryFrame.vx = remoteFrame.vx;
+      telemetryFrame.switchs = remoteFrame.switchs;
 
-  bool enabled = ui(image, threshold);
+      writeModem(fd, telemetryFrame);
+     }
+     break;
 
-  autopilot(image, enabled);
+    case EVENTCAPTURE: {
+     if(!retrieveFrame(grabber, image)) {
+      if(grabber.failed)                                     // Comme une caméra absente au démarrage
+       run = false;
+      break;
+     }
 
-  if(updated) {
-   for(int i = 1; i < NBCOMMANDS; i++) {
-    telemetryFrame.xy[i][0] = remoteFrame.xy[i][0];
-    telemetryFrame.xy[i][1] = remoteFrame.xy[i][1];
-   }
-   telemetryFrame.z = remoteFrame.z;
-   telemetryFrame.vx = remoteFrame.vx;
-   telemetryFrame.switchs = remoteFrame.switchs;
+     colorsEngine(image, threshold);
 
-   writeModem(fd, telemetryFrame);
-  }
+     bool enabled = ui(image, threshold);
 
-  fwrite(image.data, size, 1, stdout);
+     autopilot(image, enabled);
+
+     if(!writeFrame(output, image.data))
+      run = false;
+     releaseFrame(grabber);
+    } break;
+
+   }
+  }
  }
 
+ stopGrabber(grabber);
+ closeOutput(output);
+
  fprintf(stderr, "Stopping capture\n");
  capture.release();
 
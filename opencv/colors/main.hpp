@@ -53,6 +53,7 @@ typedef struct Feature {
 int width;
 int height;
 int fps;
+bool yuv = false;
 
 volatile bool run = true;
 
@@ -1,3 +1,5 @@
+#include "common.hpp"
+
 int mapInteger(int n, int inMin, int inMax, int outMin, int outMax) {
  return (n - inMin) * (outMax - outMin) / (inMax - inMin) + outMin;
 }
@@ -23,3 +25,9 @@ double constrain(double n, double min, double max) {
 
  return n;
 }
+
+uint64_t getTimeNs(clockid_t clock) {
+ struct timespec ts;
+ clock_gettime(clock, &ts);
+ return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
@@ -0,0 +1,188 @@
+#include "draw.hpp"
+
+using namespace std;
+using namespace cv;
+
+// Une image YUV 4:2:0 (I420) est un Mat CV_8UC1 de height * 3 / 2 lignes :
+// le plan Y en pleine résolution puis les plans U et V en demi-résolution.
+// Les primitives tracent la luminance en pleine résolution et la chrominance
+// avec un décalage d'un bit (shift = 1), les coordonnées restent celles de l'image.
+// Le format est passé par l'appelant, un Mat CV_8UC1 peut aussi être une image en niveaux de gris.
+
+int imageSize(int width, int height, bool yuv) {
+ if(yuv)
+  return width * height * 3 / 2;
+ else
+  return width * height * 3;
+}
+
+void yuvPlanes(Mat &image, Mat &y, Mat &u, Mat &v) {
+ int width = image.cols;
+ int height = image.rows * 2 / 3;
+ uchar *data = image.data;
+
+ y = Mat(height, width, CV_8UC1, data);
+ data += width * height;
+ u = Mat(height / 2, width / 2, CV_8UC1, data);
+ data += width * height / 4;
+ v = Mat(height / 2, width / 2, CV_8UC1, data);
+}
+
+static void bgrToYuv(const Scalar &color, Scalar &y, Scalar &u, Scalar &v) {
+ double b = color[0];
+ double g = color[1];
+ double r = color[2];
+
+ y = Scalar::all(16.0 + (65.738 * r + 129.057 * g + 25.064 * b) / 256.0);
+ u = Scalar::all(128.0 + (-37.945 * r - 74.494 * g + 112.439 * b) / 256.0);
+ v = Scalar::all(128.0 + (112.439 * r - 94.154 * g - 18.285 * b) / 256.0);
+}
+
+static int chromaThickness(int thickness) {
+ if(thickness < 0)
+  return thickness;
+ return max(1, (thickness + 1) / 2);
+}
+
+void createImage(Mat &image, int width, int height, bool yuv) {
+ if(yuv)
+  image.create(height * 3 / 2, width, CV_8UC1);
+ else
+  image.create(height, width, CV_8UC3);
+ clearImage(image, yuv);
+}
+
+void clearImage(Mat &image, bool yuv) {
+ if(yuv) {
+  Mat y, u, v;
+  yuvPlanes(image, y, u, v);
+  y = Scalar::all(YUVBLACK);
+  u = Scalar::all(YUVNEUTRAL);
+  v = Scalar::all(YUVNEUTRAL);
+ } else
+  image = Scalar::all(0);
+}
+
+void drawPixel(Mat &image, Point point, const Scalar &color, bool yuv) {
+ if(!yuv) {
+  image.at<Vec3b>(point.y, point.x) = Vec3b(color[0], color[1], color[2]);
+  return;
+ }
+
+ Mat y, u, v;
+ Scalar colorY, colorU, colorV;
+ yuvPlanes(image, y, u, v);
+ bgrToYuv(color, colorY, colorU, colorV);
+
+ y.at<uchar>(point.y, point.x) = colorY[0];
+ u.at<uchar>(point.y / 2, point.x / 2) = colorU[0];
+ v.at<uchar>(point.y / 2, point.x / 2) = colorV[0];
+}
+
+void drawLine(Mat &image, Point point1, Point point2, const Scalar &color, int thickness, int lineType, bool yuv) {
+ if(!yuv) {
+  line(image, point1, point2, color, thickness, lineType);
+  return;
+ }
+
+ Mat y, u, v;
+ Scalar colorY, colorU, colorV;
+ yuvPlanes(image, y, u, v);
+ bgrToYuv(color, colorY, colorU, colorV);
+
+ line(y, point1, point2, colorY, thickness, lineType);
+ line(u, point1, point2, colorU, chromaThickness(thickness), lineType, 1);
+ line(v, point1, point2, colorV, chromaThickness(thickness), lineType, 1);
+}
+
+void drawCircle(Mat &image, Point center, int radius, const Scalar &color, int thickness, int lineType, bool yuv) {
+ if(!yuv) {
+  circle(image, center, radius, color, thickness, lineType);
+  return;
+ }
+
+ Mat y, u, v;
+ Scalar colorY, colorU, colorV;
+ yuvPlanes(image, y, u, v);
+ bgrToYuv(color, colorY, colorU, colorV);
+
+ circle(y, center, radius, colorY, thickness, lineType);
+ circle(u, center, radius, colorU, chromaThickness(thickness), lineType, 1);
+ circle(v, center, radius, colorV, chromaThickness(thickness), lineType, 1);
+}
+
+void drawEllipse(Mat &image, Point center, Size axes, double angle, double startAngle, double endAngle,
+                 const Scalar &color, int thickness, int lineType, bool yuv) {
+ if(!yuv) {
+  ellipse(image, center, axes, angle, startAngle, endAngle, color, thickness, lineType);
+  return;
+ }
+
+ Mat y, u, v;
+ Scalar colorY, colorU, colorV;
+ yuvPlanes(image, y, u, v);
+ bgrToYuv(color, colorY, colorU, colorV);
+
+ ellipse(y, center, axes, angle, startAngle, endAngle, colorY, thickness, lineType);
+ ellipse(u, center, axes, angle, startAngle, endAngle, colorU, chromaThickness(thickness), lineType, 1);
+ ellipse(v, center, axes, angle, startAngle, endAngle, colorV, chromaThickness(thickness), lineType, 1);
+}
+
+void drawRectangle(Mat &image, Rect rect, const Scalar &color, int thickness, bool yuv) {
+ if(!yuv) {
+  rectangle(image, rect, color, thickness);
+  return;
+ }
+
+ Mat y, u, v;
+ Scalar colorY, colorU, colorV;
+ yuvPlanes(image, y, u, v);
+ bgrToYuv(color, colorY, colorU, colorV);
+
+ Point point1 = rect.tl();
+ Point point2 = rect.br() - Point(1, 1);
+ rectangle(y, point1, point2, colorY, thickness);
+ rectangle(u, point1, point2, colorU, chromaThickness(thickness), LINE_8, 1);
+ rectangle(v, point1, point2, colorV, chromaThickness(thickness), LINE_8, 1);
+}
+
+void drawPolygons(Mat &image, const vector<vector<Point>> &polygons, const Scalar &color, int thickness, int lineType, bool yuv) {
+ if(!yuv) {
+  drawContours(image, polygons, -1, color, thickness, lineType);
+  return;
+ }
+
+ Mat y, u, v;
+ Scalar colorY, colorU, colorV;
+ yuvPlanes(image, y, u, v);
+ bgrToYuv(color, colorY, colorU, colorV);
+
+ drawContours(y, polygons, -1, colorY, thickness, lineType);
+ for(int i = 0; i < polygons.size(); i++) {
+  const Point *points = polygons[i].data();
+  int n = polygons[i].size();
+  if(thickness < 0) {
+   fillPoly(u, &points, &n, 1, colorU, lineType, 1);
+   fillPoly(v, &points, &n, 1, colorV, lineType, 1);
+  } else {
+   polylines(u, &points, &n, 1, true, colorU, chromaThickness(thickness), lineType, 1);
+   polylines(v, &points, &n, 1, true, colorV, chromaThickness(thickness), lineType, 1);
+  }
+ }
+}
+
+void drawText(Mat &image, const char *text, Point org, int fontFace, double fontScale, const Scalar &color, int thickness, bool yuv) {
+ if(!yuv) {
+  putText(image, text, org, fontFace, fontScale, color, thickness);
+  return;
+ }
+
+ Mat y, u, v;
+ Scalar colorY, colorU, colorV;
+ yuvPlanes(image, y, u, v);
+ bgrToYuv(color, colorY, colorU, colorV);
+
+ putText(y, text, org, fontFace, fontScale, colorY, thickness);  // putText n'a pas de shift, la chrominance est tracée à l'échelle moitié
+ putText(u, text, org / 2, fontFace, fontScale / 2.0, colorU, chromaThickness(thickness));
+ putText(v, text, org / 2, fontFace, fontScale / 2.0, colorV, chromaThickness(thickness));
+}
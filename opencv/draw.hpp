@@ -0,0 +1,19 @@
+#include <opencv2/opencv.hpp>
+
+#define YUVBLACK 16                                          // Noir en YUV 4:2:0 limité (BT.601)
+#define YUVNEUTRAL 128
+#define YUVLUMARANGE 219                                     // Excursions de la plage limitée, de 16 à 235 et de 16 à 240
+#define YUVCHROMARANGE 224
+
+int imageSize(int width, int height, bool yuv);
+void yuvPlanes(cv::Mat &image, cv::Mat &y, cv::Mat &u, cv::Mat &v);
+void createImage(cv::Mat &image, int width, int height, bool yuv);
+void clearImage(cv::Mat &image, bool yuv);
+void drawPixel(cv::Mat &image, cv::Point point, const cv::Scalar &color, bool yuv);
+void drawLine(cv::Mat &image, cv::Point point1, cv::Point point2, const cv::Scalar &color, int thickness, int lineType, bool yuv);
+void drawCircle(cv::Mat &image, cv::Point center, int radius, const cv::Scalar &color, int thickness, int lineType, bool yuv);
+void drawEllipse(cv::Mat &image, cv::Point center, cv::Size axes, double angle, double startAngle, double endAngle,
+                 const cv::Scalar &color, int thickness, int lineType, bool yuv);
+void drawRectangle(cv::Mat &image, cv::Rect rect, const cv::Scalar &color, int thickness, bool yuv);
+void drawPolygons(cv::Mat &image, const std::vector<std::vector<cv::Point>> &polygons, const cv::Scalar &color, int thickness, int lineType, bool yuv);
+void drawText(cv::Mat &image, const char *text, cv::Point org, int fontFace, double fontScale, const cv::Scalar &color, int thickness, bool yuv);
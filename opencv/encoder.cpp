@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "common.hpp"
+#include "encoder.hpp"
+
+extern "C" {
+#include <libavutil/opt.h>
+#include <libavutil/imgutils.h>
+}
+
+static int connectLocal(int port) {
+ int sock = socket(AF_INET, SOCK_STREAM, 0);
+ if(sock == -1)
+  return -1;
+
+ struct sockaddr_in addr = {};
+ addr.sin_family = AF_INET;
+ addr.sin_port = htons(port);
+ addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+ if(connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+  close(sock);
+  return -1;
+ }
+
+ int flag = 1;                                               // Chaque unité NAL part tout de suite
+ setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+ return sock;
+}
+
+static bool writeAll(int sock, const uint8_t *data, int size) {
+ while(size > 0) {
+  int n = send(sock, data, size, MSG_NOSIGNAL);              // Pas de SIGPIPE si le client ferme, l'erreur remonte
+  if(n == -1 && errno == EINTR)
+   continue;
+  if(n <= 0)
+   return false;
+  data += n;
+  size -= n;
+ }
+ return true;
+}
+
+static bool drainEncoder(Encoder &encoder) {
+ while(avcodec_receive_packet(encoder.context, encoder.packet) == 0) {
+  bool ok = writeAll(encoder.sock, encoder.packet->data, encoder.packet->size);
+  encoder.bytes += encoder.packet->size;
+  if(encoder.packet->flags & AV_PKT_FLAG_KEY)
+   encoder.keyframes++;
+  av_packet_unref(encoder.packet);
+  if(!ok) {
+   fprintf(stderr, "Error writing H.264 stream\n");
+   return false;
+  }
+ }
+ return true;
+}
+
+bool openEncoder(Encoder &encoder, const EncoderSettings &settings, int width, int height, int fps, bool yuv) {
+ encoder = {};
+ encoder.sock = -1;
+
+ const AVCodec *codec = avcodec_find_encoder_by_name(ENCODERCODEC);
+ if(codec == NULL) {
+  fprintf(stderr, "Error finding encoder %s\n", ENCODERCODEC);
+  return false;
+ }
+
+ AVCodecContext *context = avcodec_alloc_context3(codec);
+ context->width = width;
+ context->height = height;
+ context->pix_fmt = AV_PIX_FMT_YUV420P;
+ context->time_base = {1, fps};
+ context->framerate = {fps, 1};
+ context->gop_size = settings.keyframes;
+ context->max_b_frames = 0;
+ context->bit_rate = settings.bitrate;
+ context->rc_max_rate = settings.bitrate;
+ context->rc_buffer_size = int64_t(settings.bitrate) * ENCODERVBV / 1000;
+
+ av_opt_set(context->priv_data, "preset", ENCODERPRESET, 0);
+ av_opt_set(context->priv_data, "tune", ENCODERTUNE, 0);
+ av_opt_set(context->priv_data, "profile", ENCODERPROFILE, 0);
+
+ if(avcodec_open2(context, codec, NULL) < 0) {               // Sans AV_CODEC_FLAG_GLOBAL_HEADER les SPS/PPS précèdent chaque image clé
+  fprintf(stderr, "Error opening encoder %s\n", ENCODERCODEC);
+  avcodec_free_context(&context);
+  return false;
+ }
+ encoder.context = context;
+
+ encoder.frame = av_frame_alloc();
+ encoder.frame->format = AV_PIX_FMT_YUV420P;
+ encoder.frame->width = width;
+ encoder.frame->height = height;
+ av_frame_get_buffer(encoder.frame, 0);
+
+ encoder.packet = av_packet_alloc();
+
+ if(!yuv)
+  encoder.sws = sws_getContext(width, height, AV_PIX_FMT_BGR24,
+                               width, height, AV_PIX_FMT_YUV420P,
+                               SWS_FAST_BILINEAR, NULL, NULL, NULL);
+
+ encoder.sock = connectLocal(settings.port);
+ if(encoder.sock == -1) {
+  fprintf(stderr, "Error connecting to tcp://127.0.0.1:%d\n", settings.port);
+  closeEncoder(encoder);
+  return false;
+ }
+
+ fprintf(stderr, "Encoding %s %dx%d %d fps %d b/s keyframe every %d frames to tcp://127.0.0.1:%d\n",
+                 ENCODERCODEC, width, height, fps, settings.bitrate, settings.keyframes, settings.port);
+
+ encoder.start = getTimeNs(CLOCK_MONOTONIC);
+ return true;
+}
+
+bool loadFrame(Encoder &encoder, const uint8_t *data) {      // Seule copie de l'image, convertie au passage si besoin
+ encoder.loadStart = getTimeNs(CLOCK_MONOTONIC);
+
+ if(av_frame_make_writable(encoder.frame) < 0)
+  return false;
+
+ int width = encoder.context->width;
+ int height = encoder.context->height;
+
+ if(encoder.sws) {
+  const uint8_t *src[1] = {data};
+  int srcStride[1] = {width * 3};
+  sws_scale(encoder.sws, src, srcStride, 0, height,
+            encoder.frame->data, encoder.frame->linesize);
+ } else {
+  const uint8_t *src[4] = {data, data + width * height, data + width * height * 5 / 4, NULL};
+  int srcStride[4] = {width, width / 2, width / 2, 0};
+  av_image_copy(encoder.frame->data, encoder.frame->linesize, src, srcStride,
+                AV_PIX_FMT_YUV420P, width, height);
+ }
+
+ return true;
+}
+
+bool sendFrame(Encoder &encoder) {
+ encoder.frame->pts = encoder.pts++;
+ if(avcodec_send_frame(encoder.context, encoder.frame) < 0) {
+  fprintf(stderr, "Error encoding frame\n");
+  return false;
+ }
+
+ if(!drainEncoder(encoder))
+  return false;
+
+ uint64_t now = getTimeNs(CLOCK_MONOTONIC);
+ encoder.encodeTime += now - encoder.loadStart;
+ encoder.frames++;
+
+ if(now - encoder.start >= ENCODERSTATSPERIOD * 1000000000ULL) {
+  uint64_t period = now - encoder.start;
+  fprintf(stderr, "Encoder %llu fps %llu b/s %u keyframes %llu us/frame\n",
+                  (unsigned long long) (encoder.frames * 1000000000ULL / period),
+                  (unsigned long long) (encoder.bytes * 8 * 1000000000ULL / period),
+                  encoder.keyframes,
+                  (unsigned long long) (encoder.encodeTime / 1000 / encoder.frames));
+  encoder.start = now;
+  encoder.encodeTime = 0;
+  encoder.bytes = 0;
+  encoder.frames = 0;
+  encoder.keyframes = 0;
+ }
+
+ return true;
+}
+
+bool encodeFrame(Encoder &encoder, const uint8_t *data) {
+ return loadFrame(encoder, data) && sendFrame(encoder);
+}
+
+void closeEncoder(Encoder &encoder) {
+ if(encoder.context && encoder.sock != -1) {
+  avcodec_send_frame(encoder.context, NULL);
+  drainEncoder(encoder);
+ }
+
+ if(encoder.sock != -1)
+  close(encoder.sock);
+ sws_freeContext(encoder.sws);
+ av_packet_free(&encoder.packet);
+ av_frame_free(&encoder.frame);
+ avcodec_free_context(&encoder.context);
+}
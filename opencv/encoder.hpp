@@ -0,0 +1,42 @@
+#include <stdint.h>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libswscale/swscale.h>
+}
+
+#define ENCODERCODEC "libx264"
+#define ENCODERPRESET "ultrafast"
+#define ENCODERTUNE "zerolatency"
+#define ENCODERPROFILE "baseline"
+#define ENCODERBITRATE 1000000
+#define ENCODERKEYFRAMES 60
+#define ENCODERVBV 500                                       // Millisecondes de débit dans le tampon du contrôleur
+#define ENCODERSTATSPERIOD 10
+
+typedef struct EncoderSettings {
+ int port;
+ int bitrate;
+ int keyframes;
+} EncoderSettings;
+
+typedef struct Encoder {
+ AVCodecContext *context;
+ AVFrame *frame;
+ AVPacket *packet;
+ SwsContext *sws;                                            // NULL si les images sont déjà en YUV 4:2:0
+ int sock;
+ int64_t pts;
+ uint64_t loadStart;
+ uint64_t start;
+ uint64_t encodeTime;
+ uint64_t bytes;
+ uint32_t frames;
+ uint32_t keyframes;
+} Encoder;
+
+bool openEncoder(Encoder &encoder, const EncoderSettings &settings, int width, int height, int fps, bool yuv);
+bool loadFrame(Encoder &encoder, const uint8_t *data);
+bool sendFrame(Encoder &encoder);
+bool encodeFrame(Encoder &encoder, const uint8_t *data);
+void closeEncoder(Encoder &encoder);
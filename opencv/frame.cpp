@@ -1,51 +1,81 @@
-#include <wiringSerial.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "common.hpp"
 #include "frame.hpp"
 
-bool readModem(int fd, RemoteFrame &remoteFrame) {
- uint8_t octet;
- static uint8_t pos = 0;
- uint8_t p;
-
- while(serialDataAvail(fd)) {
-  octet = serialGetchar(fd);
-
-  switch(pos) {
-
-   case 0:
-    if(octet == '$')
-     pos = 1;
-    break;
-
-   case 1:
-    if(octet == 'S')
-     pos = 2;
-    else
-     pos = 0;
-    break;
-
-   case 2:
-   case 3:
-    if(octet == ' ')
-     pos++;
-    else
-     pos = 0;
-    break;
-
-   default:
-    remoteFrame.bytes[pos++] = octet;
-    if(pos == REMOTEFRAMESIZE) {
-     pos = 0;
-     serialFlush(fd);
-     return true;
-    }
+#ifdef MODEMSTATSPERIOD
+static void reportStats(ModemLink &link) {
+ uint64_t now = getTimeNs(CLOCK_MONOTONIC);
 
+ if(!link.start) {
+  link.start = now;
+  return;
+ }
+
+ uint64_t elapsed = now - link.start;
+ if(elapsed < uint64_t(MODEMSTATSPERIOD) * 1000000000)
+  return;
+
+ double seconds = double(elapsed) / 1000000000.0;
+ fprintf(stderr, "Modem %d frames/s | %d resyncs | %d bytes discarded\n",
+         int(link.frames / seconds), link.resyncs, link.discarded);
+
+ link.start = now;
+ link.frames = 0;
+ link.resyncs = 0;
+ link.discarded = 0;
+}
+#endif
+
+bool parseModem(ModemLink &link, const uint8_t *data, int size, RemoteFrame &remoteFrame) {
+ const uint8_t header[HEADERSIZE] = {'$', 'S', ' ', ' '};
+ bool updated = false;
+
+ for(int i = 0; i < size; i++) {
+  uint8_t octet = data[i];
+
+  if(link.pos < HEADERSIZE) {
+   if(octet == header[link.pos])
+    link.frame.bytes[link.pos++] = octet;
+   else {
+    if(link.pos) {                                           // En-tête incomplet
+     link.resyncs++;
+     link.discarded += link.pos;
+    } else
+     link.discarded++;
+
+    link.pos = 0;
+    if(octet == header[0])
+     link.frame.bytes[link.pos++] = octet;
+   }
+   continue;
+  }
+
+  link.frame.bytes[link.pos++] = octet;
+  if(link.pos == REMOTEFRAMESIZE) {                          // Seule la trame la plus récente est conservée
+   remoteFrame = link.frame;
+   link.frames++;
+   link.pos = 0;
+   updated = true;
   }
  }
 
- return false;
+ return updated;
+}
+
+bool readModem(int fd, ModemLink &link, RemoteFrame &remoteFrame) {
+ uint8_t data[MODEMBUFFERSIZE];
+
+ int n = read(fd, data, MODEMBUFFERSIZE);
+ bool updated = n > 0 && parseModem(link, data, n, remoteFrame);
+
+#ifdef MODEMSTATSPERIOD
+ reportStats(link);
+#endif
+
+ return updated;
 }
 
 void writeModem(int fd, TelemetryFrame &telemetryFrame) {
- for(int i = 0; i < TELEMETRYFRAMESIZE; i++)
-  serialPutchar(fd, telemetryFrame.bytes[i]);
+ write(fd, telemetryFrame.bytes, TELEMETRYFRAMESIZE);
 }
@@ -6,6 +6,8 @@
 #define TELEMETRYFRAMESIZE 25
 #define HEADERSIZE 4
 #define NBCOMMANDS 2
+#define MODEMBUFFERSIZE 256
+#define MODEMSTATSPERIOD 10 // Seconds, comment to disable the statistics
 
 typedef struct {
  union {
@@ -50,5 +52,15 @@ typedef struct {
  };
 } TelemetryFrame;
 
-bool readModem(int fd, RemoteFrame &remoteFrame);
+typedef struct ModemLink {
+ RemoteFrame frame;                                          // Trame en cours de réception
+ uint8_t pos;
+ uint64_t start;
+ uint32_t frames;
+ uint32_t resyncs;
+ uint32_t discarded;
+} ModemLink;
+
+bool parseModem(ModemLink &link, const uint8_t *data, int size, RemoteFrame &remoteFrame);
+bool readModem(int fd, ModemLink &link, RemoteFrame &remoteFrame);
 void writeModem(int fd, TelemetryFrame &telemetryFrame);
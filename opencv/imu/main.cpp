@@ -8,6 +8,10 @@
 #include <RTIMULib.h>
 #include "../common.hpp"
 #include "../frame.hpp"
+#include "../loop.hpp"
+#include "../capture.hpp"
+#include "../output.hpp"
+#include "../draw.hpp"
 #include "main.hpp"
 
 using namespace std;
@@ -49,8 +53,8 @@ void imuThread() {
 
 void watch(Mat &image, double angle, Point center, int diam, Scalar color1, Scalar color2) {
  double angleDeg = angle * 180.0 / M_PI;
- ellipse(image, center, Point(diam, diam), angleDeg, 0.0, 180.0, color1, FILLED, LINE_AA);
- ellipse(image, center, Point(diam, diam), angleDeg, 0.0, -180.0, color2, FILLED, LINE_AA);
+ drawEllipse(image, center, Point(diam, diam), angleDeg, 0.0, 180.0, color1, FILLED, LINE_AA, yuv);
+ drawEllipse(image, center, Point(diam, diam), angleDeg, 0.0, -180.0, color2, FILLED, LINE_AA, yuv);
 }
 
 void autopilot(Mat &image) {
@@ -181,7 +185,7 @@ void autopilot(Mat &image) {
 #endif
 
  if(select)
-  circle(image, Point(x3, y1), DIAM1 + select, Scalar::all(255), select, LINE_AA);
+  drawCircle(image, Point(x3, y1), DIAM1 + select, Scalar::all(255), select, LINE_AA, yuv);
 }
 
 int main(int argc, char* argv[]) {
@@ -189,14 +193,41 @@ int main(int argc, char* argv[]) {
 
  signal(SIGTERM, signal_callback_handler);
 
- if(argc != 4) {
+ int outputMode = OUTPUTPIPE;
+ EncoderSettings encoderSettings = {0, ENCODERBITRATE, ENCODERKEYFRAMES};
+ int opt;
+ while((opt = getopt(argc, argv, "yse:b:g:")) != -1) {
+  switch(opt) {
+   case 'y':
+    yuv = true;
+    break;
+   case 's':
+    outputMode = OUTPUTSHM;
+    break;
+   case 'e':
+    outputMode = OUTPUTH264;
+    sscanf(optarg, "%d", &encoderSettings.port);
+    break;
+   case 'b':
+    sscanf(optarg, "%d", &encoderSettings.bitrate);
+    break;
+   case 'g':
+    sscanf(optarg, "%d", &encoderSettings.keyframes);
+    break;
+   default:
+    fprintf(stderr, "Usage: %s [-y] [-s | -e port [-b bitrate] [-g keyframes]] [width height fps]\n", argv[0]);
+    return 1;
+  }
+ }
+
+ if(argc - optind != 3) {
   width = WIDTH;
   height = HEIGHT;
   fps = FPS;
  } else {
-  sscanf(argv[1], "%d", &width);
-  sscanf(argv[2], "%d", &height);
-  sscanf(argv[3], "%d", &fps);
+  sscanf(argv[optind], "%d", &width);
+  sscanf(argv[optind + 1], "%d", &height);
+  sscanf(argv[optind + 2], "%d", &fps);
  }
 
  int fd = serialOpen(SERIALPORT, SERIALRATE);
@@ -216,19 +247,27 @@ int main(int argc, char* argv[]) {
  }
 
  Mat image;
- int size = width * height * 3;
 
  telemetryFrame.header[0] = '$';
  telemetryFrame.header[1] = 'R';
  telemetryFrame.header[2] = ' ';
  telemetryFrame.header[3] = ' ';
 
+ Output output;
+ if(!openOutput(output, outputMode, actualStdout, encoderSettings, width, height, fps, yuv))
+  return 1;
+
  fprintf(stderr, "Starting capture\n");
  VideoCapture capture;
  capture.open(0);
 
- TickMeter tickMeter;
- int time = 0;
+ Grabber grabber;
+ int timer = -1;
+
+ ModemLink modemLink = {};
+
+ int epfd = createLoop();
+ addToLoop(epfd, fd, EVENTMODEM);
 
  bool captureEnabled = capture.isOpened();
  if(captureEnabled) {
@@ -236,50 +275,66 @@ int main(int argc, char* argv[]) {
   capture.set(CAP_PROP_FRAME_WIDTH, width);
   capture.set(CAP_PROP_FRAME_HEIGHT, height);
   capture.set(CAP_PROP_FPS, fps);
- } else
+  startGrabber(grabber, capture, yuv);
+  addToLoop(epfd, grabber.grabbed, EVENTCAPTURE);
+ } else {
   fprintf(stderr, "Error starting capture\n");
+  timer = createTimer(fps);
+  addToLoop(epfd, timer, EVENTFRAME);
+ }
 
  while(run) {
-  if(captureEnabled) {
-   capture.read(image);
-  } else {
-   image = Mat::zeros(Size(width, height), CV_8UC3);
-   int wait = 1000000 / fps - time * 1000;
-   if(wait > 0)
-    usleep(wait);
-  }
-
-  tickMeter.start();
-
-  bool updated = readModem(fd, remoteFrame);
-
-  autopilot(image);
+  int ids[NBEVENTSMAX];
+  int n = waitLoop(epfd, ids, LOOPTIMEOUT);
+
+  for(int i = 0; i < n; i++) {
+   switch(ids[i]) {
+
+    case EVENTMODEM:
+     if(readModem(fd, modemLink, remoteFrame)) {
+      for(int j = 0; j < NBCOMMANDS; j++) {
+       telemetryFrame.xy[j][0] = remoteFrame.xy[j][0];
+       telemetryFrame.xy[j][1] = remoteFrame.xy[j][1];
+      }
+      telemetryFrame.z = remoteFrame.z;
+      telemetryFrame.vx = remoteFrame.vx;
+      telemetryFrame.vy = remoteFrame.vy;
+      telemetryFrame.switchs = remoteFrame.switchs;
+
+      writeModem(fd, telemetryFrame);
+     }
+     break;
+
+    case EVENTCAPTURE:
+    case EVENTFRAME:
+     if(captureEnabled) {
+      if(!retrieveFrame(grabber, image))
+       break;
+     } else {
+      readEvent(timer);
+      createImage(image, width, height, yuv);
+     }
+
+     autopilot(image);
+
+     if(!writeFrame(output, image.data))
+      run = false;
+     if(captureEnabled)
+      releaseFrame(grabber);
+     break;
 
-  if(updated) {
-   for(int i = 0; i < NBCOMMANDS; i++) {
-    telemetryFrame.xy[i][0] = remoteFrame.xy[i][0];
-    telemetryFrame.xy[i][1] = remoteFrame.xy[i][1];
    }
-   telemetryFrame.z = remoteFrame.z;
-   telemetryFrame.vx = remoteFrame.vx;
-   telemetryFrame.vy = remoteFrame.vy;
-   telemetryFrame.switchs = remoteFrame.switchs;
-
-   writeModem(fd, telemetryFrame);
   }
-
-  fwrite(image.data, size, 1, actualStdout);
-
-  tickMeter.stop();
-  time = tickMeter.getTimeMilli();
-  tickMeter.reset();
  }
 
  if(captureEnabled) {
   fprintf(stderr, "Stopping capture\n");
+  stopGrabber(grabber);
   capture.release();
  }
 
+ closeOutput(output);
+
  fprintf(stderr, "Stopping\n");
  return 0;
 }
@@ -30,6 +30,7 @@ enum {
 int width;
 int height;
 int fps;
+bool yuv = false;
 
 volatile bool run = true;
 
@@ -0,0 +1,163 @@
+#include <algorithm>
+#include <cmath>
+#include "field.hpp"
+
+#define TILESIDE (FIELDTILE * FIELDRESOLUTION)
+#define TILENODES (FIELDTILE + 1)
+
+using namespace std;
+using namespace cv;
+
+static int floorDiv(int x, int d) {
+ if(x >= 0)
+  return x / d;
+ return (x + 1) / d - 1;                                     // Arrondi vers moins l'infini
+}
+
+static uint64_t tileKey(int tx, int ty) {
+ return uint64_t(uint32_t(tx)) << 32 | uint32_t(ty);
+}
+
+static void tileRange(Point a, Point b, int &txMin, int &txMax, int &tyMin, int &tyMax) {
+ txMin = floorDiv(min(a.x, b.x) - FIELDMAXDIST - 1, TILESIDE); // Une tuile inclut aussi sa bordure droite
+ txMax = floorDiv(max(a.x, b.x) + FIELDMAXDIST, TILESIDE);
+ tyMin = floorDiv(min(a.y, b.y) - FIELDMAXDIST - 1, TILESIDE);
+ tyMax = floorDiv(max(a.y, b.y) + FIELDMAXDIST, TILESIDE);
+}
+
+static void markTile(DistanceField &field, uint64_t key, FieldTile &tile) {
+ if(!tile.dirty) {
+  tile.dirty = true;
+  field.dirty.push_back(key);
+ }
+}
+
+static void stampTile(FieldTile &tile, int tx, int ty, Point a, Point b) {
+ int x0 = tx * TILESIDE;
+ int y0 = ty * TILESIDE;
+ int iMin = max(floorDiv(min(a.x, b.x) - FIELDMAXDIST - x0, FIELDRESOLUTION), 0);
+ int iMax = min(floorDiv(max(a.x, b.x) + FIELDMAXDIST - x0, FIELDRESOLUTION) + 1, FIELDTILE);
+ int jMin = max(floorDiv(min(a.y, b.y) - FIELDMAXDIST - y0, FIELDRESOLUTION), 0);
+ int jMax = min(floorDiv(max(a.y, b.y) + FIELDMAXDIST - y0, FIELDRESOLUTION) + 1, FIELDTILE);
+
+ double dx = b.x - a.x;
+ double dy = b.y - a.y;
+ double sqLength = dx * dx + dy * dy;
+
+ for(int j = jMin; j <= jMax; j++) {
+  float *row = &tile.nodes[j * TILENODES];
+  double py = y0 + j * FIELDRESOLUTION - a.y;
+
+  for(int i = iMin; i <= iMax; i++) {
+   double px = x0 + i * FIELDRESOLUTION - a.x;
+   double ratio = 0.0;
+   if(sqLength > 0.0)
+    ratio = min(max((px * dx + py * dy) / sqLength, 0.0), 1.0);
+
+   float dist = sqrt((px - ratio * dx) * (px - ratio * dx) + (py - ratio * dy) * (py - ratio * dy));
+   if(dist < row[i])
+    row[i] = dist;
+  }
+ }
+}
+
+void clearField(DistanceField &field) {
+ field.tiles.clear();
+ field.dirty.clear();
+}
+
+void insertField(DistanceField &field, Point a, Point b) {
+ int txMin, txMax, tyMin, tyMax;
+ tileRange(a, b, txMin, txMax, tyMin, tyMax);
+
+ for(int tx = txMin; tx <= txMax; tx++) {
+  for(int ty = tyMin; ty <= tyMax; ty++) {
+   uint64_t key = tileKey(tx, ty);
+   FieldTile &tile = field.tiles[key];
+   tile.segments.push_back({a, b});
+   markTile(field, key, tile);
+  }
+ }
+}
+
+void removeField(DistanceField &field, Point a, Point b) {
+ int txMin, txMax, tyMin, tyMax;
+ tileRange(a, b, txMin, txMax, tyMin, tyMax);
+
+ for(int tx = txMin; tx <= txMax; tx++) {
+  for(int ty = tyMin; ty <= tyMax; ty++) {
+   uint64_t key = tileKey(tx, ty);
+   auto it = field.tiles.find(key);
+   if(it == field.tiles.end())
+    continue;
+
+   vector<FieldSegment> &segments = it->second.segments;
+   for(int i = 0; i < segments.size(); i++) {
+    if(segments[i].a == a && segments[i].b == b) {
+     segments[i] = segments.back();
+     segments.pop_back();
+     markTile(field, key, it->second);
+     break;
+    }
+   }
+  }
+ }
+}
+
+int updateField(DistanceField &field) {
+ int n = 0;
+
+ for(int k = 0; k < field.dirty.size(); k++) {
+  auto it = field.tiles.find(field.dirty[k]);
+  if(it == field.tiles.end())
+   continue;
+
+  FieldTile &tile = it->second;
+  if(tile.segments.empty()) {                                // Plus aucun segment à portée, la mémoire est rendue
+   field.tiles.erase(it);
+   continue;
+  }
+
+  int tx = int32_t(field.dirty[k] >> 32);
+  int ty = int32_t(field.dirty[k]);
+  tile.nodes.assign(TILENODES * TILENODES, FIELDMAXDIST);
+  for(int i = 0; i < tile.segments.size(); i++)
+   stampTile(tile, tx, ty, tile.segments[i].a, tile.segments[i].b);
+  tile.dirty = false;
+  n++;
+ }
+
+ field.dirty.clear();
+ return n;
+}
+
+bool sampleField(const DistanceField &field, double x, double y, double &dist, double &gradX, double &gradY) {
+ double fx = x / FIELDRESOLUTION;
+ double fy = y / FIELDRESOLUTION;
+ int i = floor(fx);
+ int j = floor(fy);
+ int tileX = floorDiv(i, FIELDTILE);
+ int tileY = floorDiv(j, FIELDTILE);
+
+ auto it = field.tiles.find(tileKey(tileX, tileY));
+ if(it == field.tiles.end() || it->second.dirty) {
+  dist = FIELDMAXDIST;
+  gradX = 0.0;
+  gradY = 0.0;
+  return false;
+ }
+
+ double tx = fx - i;
+ double ty = fy - j;
+ const float *node = &it->second.nodes[(j - tileY * FIELDTILE) * TILENODES + i - tileX * FIELDTILE];
+ double d00 = node[0];
+ double d10 = node[1];
+ double d01 = node[TILENODES];
+ double d11 = node[TILENODES + 1];
+
+ dist = (d00 * (1.0 - tx) + d10 * tx) * (1.0 - ty) + (d01 * (1.0 - tx) + d11 * tx) * ty;
+ gradX = ((d10 - d00) * (1.0 - ty) + (d11 - d01) * ty) / FIELDRESOLUTION;
+ gradY = ((d01 - d00) * (1.0 - tx) + (d11 - d10) * tx) / FIELDRESOLUTION;
+
+ return true;
+}
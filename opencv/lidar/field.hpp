@@ -0,0 +1,30 @@
+#include <stdint.h>
+#include <vector>
+#include <unordered_map>
+#include <opencv2/opencv.hpp>
+
+#define FIELDRESOLUTION 50 // Millimeters
+#define FIELDMAXDIST 500 // Millimeters
+#define FIELDTILE 32                                         // Mailles par côté d'une tuile
+
+typedef struct FieldSegment {
+ cv::Point a;
+ cv::Point b;
+} FieldSegment;
+
+typedef struct FieldTile {                                   // (FIELDTILE + 1)² nœuds, dernière ligne et dernière colonne partagées avec les voisines
+ std::vector<float> nodes;
+ std::vector<FieldSegment> segments;                         // Segments à moins de FIELDMAXDIST de la tuile
+ bool dirty;
+} FieldTile;
+
+typedef struct DistanceField {                               // Distance tronquée au segment le plus proche, seules les tuiles proches d'un segment existent
+ std::unordered_map<uint64_t, FieldTile> tiles;
+ std::vector<uint64_t> dirty;
+} DistanceField;
+
+void clearField(DistanceField &field);
+void insertField(DistanceField &field, cv::Point a, cv::Point b);
+void removeField(DistanceField &field, cv::Point a, cv::Point b);
+int updateField(DistanceField &field);
+bool sampleField(const DistanceField &field, double x, double y, double &dist, double &gradX, double &gradY);
@@ -0,0 +1,273 @@
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include "graph.hpp"
+
+#define HEAPDONE -2                                          // Position d'un nœud dont la distance est définitive
+
+using namespace std;
+using namespace cv;
+
+static int allocRow(Graph &graph, int rowClass) {
+ vector<int> &freeRows = graph.freeRows[rowClass];
+ if(!freeRows.empty()) {
+  int start = freeRows.back();
+  freeRows.pop_back();
+  return start;
+ }
+
+ int start = graph.edges.size();
+ graph.edges.resize(start + (GRAPHROWMIN << rowClass));
+ return start;
+}
+
+static void freeRow(Graph &graph, int node) {
+ graph.freeRows[graph.rowClass[node]].push_back(graph.rowStart[node]);
+}
+
+static void pushEdge(Graph &graph, int a, int b, int weight) {
+ if(graph.rowSize[a] == GRAPHROWMIN << graph.rowClass[a]) { // Ligne pleine, recopiée dans un bloc deux fois plus grand
+  int start = allocRow(graph, graph.rowClass[a] + 1);
+  copy_n(graph.edges.begin() + graph.rowStart[a], graph.rowSize[a], graph.edges.begin() + start);
+  freeRow(graph, a);
+  graph.rowStart[a] = start;
+  graph.rowClass[a]++;
+ }
+
+ graph.edges[graph.rowStart[a] + graph.rowSize[a]++] = {b, weight};
+}
+
+static int findEdge(const Graph &graph, int a, int b) {
+ int end = graph.rowStart[a] + graph.rowSize[a];
+ for(int i = graph.rowStart[a]; i < end; i++)
+  if(graph.edges[i].node == b)
+   return i;
+ return -1;
+}
+
+static bool removeEdge(Graph &graph, int a, int b) {         // Le dernier lien de la ligne prend sa place
+ int i = findEdge(graph, a, b);
+ if(i == -1)
+  return false;
+
+ graph.rowSize[a]--;
+ graph.edges[i] = graph.edges[graph.rowStart[a] + graph.rowSize[a]];
+ return true;
+}
+
+void clearGraph(Graph &graph) {
+ graph.nodes.clear();
+ graph.rowStart.clear();
+ graph.rowSize.clear();
+ graph.rowClass.clear();
+ graph.edges.clear();
+ for(int i = 0; i < GRAPHROWCLASSES; i++)
+  graph.freeRows[i].clear();
+ graph.nbLinks = 0;
+}
+
+int addGraphNode(Graph &graph, Point point) {
+ int node = graph.nodes.size();
+ graph.nodes.push_back(point);
+ graph.rowStart.push_back(allocRow(graph, 0));
+ graph.rowSize.push_back(0);
+ graph.rowClass.push_back(0);
+ return node;
+}
+
+void addGraphLink(Graph &graph, int a, int b) {
+ Point diff = graph.nodes[a] - graph.nodes[b];
+ int weight = int(sqrt(diff.x * diff.x + diff.y * diff.y));
+
+ pushEdge(graph, a, b, weight);
+ pushEdge(graph, b, a, weight);
+ graph.nbLinks++;
+}
+
+bool delGraphLink(Graph &graph, int a, int b) {
+ if(!removeEdge(graph, a, b))
+  return false;
+
+ removeEdge(graph, b, a);
+ graph.nbLinks--;
+ return true;
+}
+
+void delGraphNode(Graph &graph, int node) {                  // Le dernier nœud prend le numéro du nœud supprimé
+ int end = graph.rowStart[node] + graph.rowSize[node];
+ for(int i = graph.rowStart[node]; i < end; i++) {
+  removeEdge(graph, graph.edges[i].node, node);
+  graph.nbLinks--;
+ }
+ freeRow(graph, node);
+
+ int last = graph.nodes.size() - 1;
+ if(node != last) {
+  graph.nodes[node] = graph.nodes[last];
+  graph.rowStart[node] = graph.rowStart[last];
+  graph.rowSize[node] = graph.rowSize[last];
+  graph.rowClass[node] = graph.rowClass[last];
+
+  end = graph.rowStart[node] + graph.rowSize[node];
+  for(int i = graph.rowStart[node]; i < end; i++)
+   graph.edges[findEdge(graph, graph.edges[i].node, last)].node = node;
+ }
+
+ graph.nodes.pop_back();
+ graph.rowStart.pop_back();
+ graph.rowSize.pop_back();
+ graph.rowClass.pop_back();
+}
+
+void graphLinks(const Graph &graph, vector<array<int, 2>> &links) {
+ links.clear();
+ for(int a = 0; a < graph.nodes.size(); a++) {
+  int end = graph.rowStart[a] + graph.rowSize[a];
+  for(int i = graph.rowStart[a]; i < end; i++)
+   if(a < graph.edges[i].node)
+    links.push_back({a, graph.edges[i].node});
+ }
+}
+
+static void siftUp(vector<int> &heap, vector<int> &positions, const vector<int> &dists, int i) {
+ int node = heap[i];
+ while(i > 0) {
+  int parent = (i - 1) / 2;
+  if(dists[heap[parent]] <= dists[node])
+   break;
+  heap[i] = heap[parent];
+  positions[heap[i]] = i;
+  i = parent;
+ }
+ heap[i] = node;
+ positions[node] = i;
+}
+
+static void siftDown(vector<int> &heap, vector<int> &positions, const vector<int> &dists, int i) {
+ int node = heap[i];
+ int size = heap.size();
+ while(true) {
+  int child = i * 2 + 1;
+  if(child >= size)
+   break;
+  if(child + 1 < size && dists[heap[child + 1]] < dists[heap[child]])
+   child++;
+  if(dists[heap[child]] >= dists[node])
+   break;
+  heap[i] = heap[child];
+  positions[heap[i]] = i;
+  i = child;
+ }
+ heap[i] = node;
+ positions[node] = i;
+}
+
+static void pushHeap(vector<int> &heap, vector<int> &positions, const vector<int> &dists, int node) {
+ if(positions[node] == -1) {
+  positions[node] = heap.size();
+  heap.push_back(node);
+ }
+ siftUp(heap, positions, dists, positions[node]);
+}
+
+static void propagate(const Graph &graph, vector<int> &heap, vector<int> &positions, vector<int> &paths, vector<int> &dists) {
+ while(!heap.empty()) {
+  int a = heap[0];
+  positions[a] = HEAPDONE;
+  int last = heap.back();
+  heap.pop_back();
+  if(!heap.empty()) {
+   heap[0] = last;
+   siftDown(heap, positions, dists, 0);
+  }
+
+  int end = graph.rowStart[a] + graph.rowSize[a];
+  for(int i = graph.rowStart[a]; i < end; i++) {
+   int b = graph.edges[i].node;
+   int dist = dists[a] + graph.edges[i].weight;
+   if(positions[b] == HEAPDONE || dist >= dists[b])
+    continue;
+
+   dists[b] = dist;
+   paths[b] = a;
+   pushHeap(heap, positions, dists, b);
+  }
+ }
+}
+
+static void seedNode(const Graph &graph, int node, vector<int> &paths, vector<int> &dists) { // Meilleur voisin déjà atteint
+ int end = graph.rowStart[node] + graph.rowSize[node];
+ for(int i = graph.rowStart[node]; i < end; i++) {
+  int b = graph.edges[i].node;
+  if(dists[b] != INT_MAX && dists[b] + graph.edges[i].weight < dists[node]) {
+   dists[node] = dists[b] + graph.edges[i].weight;
+   paths[node] = b;
+  }
+ }
+}
+
+void dijkstra(const Graph &graph, int start, vector<int> &paths, vector<int> &dists) {
+ int nbNodes = graph.nodes.size();
+ vector<int> heap;                                           // Tas binaire indexé, une seule entrée par nœud
+ vector<int> positions(nbNodes, -1);
+ paths.assign(nbNodes, -1);
+ dists.assign(nbNodes, INT_MAX);
+
+ dists[start] = 0;
+ pushHeap(heap, positions, dists, start);
+ propagate(graph, heap, positions, paths, dists);
+}
+
+void addNodesPaths(const Graph &graph, int first, vector<int> &paths, vector<int> &dists) {
+ int nbNodes = graph.nodes.size();
+ vector<int> heap;
+ vector<int> positions(nbNodes, -1);
+ paths.resize(nbNodes, -1);
+ dists.resize(nbNodes, INT_MAX);
+
+ for(int i = first; i < nbNodes; i++) {                      // Seuls les raccourcis ouverts par les nouveaux nœuds se propagent
+  seedNode(graph, i, paths, dists);
+  if(dists[i] != INT_MAX)
+   pushHeap(heap, positions, dists, i);
+ }
+ propagate(graph, heap, positions, paths, dists);
+}
+
+void delNodePaths(Graph &graph, int node, vector<int> &paths, vector<int> &dists) { // Le nœud supprimé n'est pas la racine
+ vector<int> cut(1, node);                                   // Sous-arbre des chemins qui passaient par le nœud
+ for(int i = 0; i < cut.size(); i++) {
+  int end = graph.rowStart[cut[i]] + graph.rowSize[cut[i]];
+  for(int j = graph.rowStart[cut[i]]; j < end; j++)
+   if(paths[graph.edges[j].node] == cut[i])
+    cut.push_back(graph.edges[j].node);
+ }
+ for(int i = 0; i < cut.size(); i++) {
+  paths[cut[i]] = -1;
+  dists[cut[i]] = INT_MAX;
+ }
+
+ int last = graph.nodes.size() - 1;                          // Même renumérotation que delGraphNode()
+ if(node != last) {
+  int end = graph.rowStart[last] + graph.rowSize[last];
+  for(int i = graph.rowStart[last]; i < end; i++)
+   if(paths[graph.edges[i].node] == last)
+    paths[graph.edges[i].node] = node;
+  paths[node] = paths[last];
+  dists[node] = dists[last];
+  for(int i = 1; i < cut.size(); i++)
+   if(cut[i] == last)
+    cut[i] = node;
+ }
+ delGraphNode(graph, node);
+ paths.pop_back();
+ dists.pop_back();
+
+ vector<int> heap;
+ vector<int> positions(graph.nodes.size(), -1);
+ for(int i = 1; i < cut.size(); i++) {
+  seedNode(graph, cut[i], paths, dists);
+  if(dists[cut[i]] != INT_MAX)
+   pushHeap(heap, positions, dists, cut[i]);
+ }
+ propagate(graph, heap, positions, paths, dists);
+}
@@ -0,0 +1,32 @@
+#include <stdint.h>
+#include <vector>
+#include <array>
+#include <opencv2/opencv.hpp>
+
+#define GRAPHROWMIN 4                                        // Capacité de la plus petite ligne d'adjacence
+#define GRAPHROWCLASSES 16
+
+typedef struct GraphEdge {
+ int node;
+ int weight;                                                 // Longueur du lien en millimètres, calculée une fois à l'insertion
+} GraphEdge;
+
+typedef struct Graph {                                       // Lignes d'adjacence compressées dans un seul tableau, nœuds numérotés sans trou
+ std::vector<cv::Point> nodes;
+ std::vector<int> rowStart;
+ std::vector<int> rowSize;
+ std::vector<uint8_t> rowClass;                              // Capacité GRAPHROWMIN << rowClass
+ std::vector<GraphEdge> edges;
+ std::vector<int> freeRows[GRAPHROWCLASSES];                 // Blocs libérés, réutilisés à capacité égale
+ int nbLinks;
+} Graph;
+
+void clearGraph(Graph &graph);
+int addGraphNode(Graph &graph, cv::Point point);
+void addGraphLink(Graph &graph, int a, int b);
+bool delGraphLink(Graph &graph, int a, int b);
+void delGraphNode(Graph &graph, int node);
+void graphLinks(const Graph &graph, std::vector<std::array<int, 2>> &links);
+void dijkstra(const Graph &graph, int start, std::vector<int> &paths, std::vector<int> &dists);
+void addNodesPaths(const Graph &graph, int first, std::vector<int> &paths, std::vector<int> &dists);
+void delNodePaths(Graph &graph, int node, std::vector<int> &paths, std::vector<int> &dists);
@@ -0,0 +1,111 @@
+#include <algorithm>
+#include <cmath>
+#include "hough.hpp"
+
+using namespace std;
+using namespace cv;
+
+static int cellCoord(double x, double step) {
+ return int(floor(x / step));
+}
+
+static uint64_t cellKey(int angle, int cu, int cw) {
+ return uint64_t(angle) << 48 | uint64_t(uint32_t(cu) & 0xffffff) << 24 | uint32_t(cw) & 0xffffff;
+}
+
+static int angleBucket(HoughIndex &hough, int k) {
+ int bucket = k % hough.nbAngles;
+ return bucket < 0 ? bucket + hough.nbAngles : bucket;
+}
+
+static void rotate(HoughIndex &hough, int bucket, Point2d point, double &u, double &w) {
+ Point2d axis = hough.axes[bucket];
+ u = axis.x * point.x + axis.y * point.y;
+ w = axis.x * point.y - axis.y * point.x;
+}
+
+void clearHough(HoughIndex &hough, int distTolerance, double angularTolerance) {
+ hough.nbAngles = max(1, int(ceil(2.0 * M_PI / angularTolerance)));
+ hough.angleStep = 2.0 * M_PI / hough.nbAngles;
+ hough.axes.resize(hough.nbAngles);
+ for(int i = 0; i < hough.nbAngles; i++) {
+  double angle = -M_PI + (i + 0.5) * hough.angleStep;
+  hough.axes[i] = Point2d(cos(angle), sin(angle));
+ }
+ hough.angularTolerance = angularTolerance;
+ hough.distTolerance = distTolerance;
+ hough.offsetStep = distTolerance * HOUGHOFFSETCELL;
+ hough.cells.clear();
+ hough.marks.clear();
+ hough.mark = 0;
+}
+
+void insertHough(HoughIndex &hough, int id, Point a, Point b) {
+ Point diff = b - a;
+ int bucket = angleBucket(hough, cellCoord(atan2(diff.y, diff.x) + M_PI, hough.angleStep)); // Même calcul que lineAngle()
+ double ua, wa, ub, wb;
+ rotate(hough, bucket, a, ua, wa);
+ rotate(hough, bucket, b, ub, wb);
+
+ int cuMax = cellCoord(max(ua, ub), HOUGHCELL);
+ int cwMin = cellCoord(min(wa, wb), hough.offsetStep);
+ int cwMax = cellCoord(max(wa, wb), hough.offsetStep);
+
+ for(int cu = cellCoord(min(ua, ub), HOUGHCELL); cu <= cuMax; cu++) {
+  for(int cw = cwMin; cw <= cwMax; cw++)
+   hough.cells[cellKey(bucket, cu, cw)].push_back({id, float(min(ua, ub)), float(max(ua, ub))});
+ }
+
+ if(id >= hough.marks.size())
+  hough.marks.resize(id + 1, 0);
+}
+
+// Candidats de testLines(line(a, b), j, distTolerance, angularTolerance, lengthMargin) : j a sa direction à
+// angularTolerance près, le milieu de (a, b) est à distTolerance de la droite de j et sa projection tombe sur j
+// prolongé de la demi-longueur de (a, b) plus lengthMargin. Dans le repère de la classe de j, l'écart à la
+// direction de j est d'au plus angleStep / 2, d'où la fenêtre ci-dessous.
+void queryHough(HoughIndex &hough, Point a, Point b, int lengthMargin, vector<int> &ids) {
+ ids.clear();
+ hough.mark++;
+ if(!hough.mark) {
+  fill(hough.marks.begin(), hough.marks.end(), 0);
+  hough.mark = 1;
+ }
+
+ Point diff = b - a;
+ double angle = atan2(diff.y, diff.x);
+ double extension = sqrt(double(diff.x) * diff.x + double(diff.y) * diff.y) / 2.0 + max(lengthMargin, 0) + HOUGHSLACK;
+ double marginU = extension + hough.distTolerance + HOUGHSLACK;
+ double spread = hough.angleStep < M_PI ? sin(hough.angleStep / 2.0) : 1.0;
+ double marginW = extension * spread + hough.distTolerance + HOUGHSLACK;
+ Point middle = (a + b) / 2;
+
+ int first = cellCoord(angle - hough.angularTolerance - 1e-9 + M_PI, hough.angleStep);
+ int last = cellCoord(angle + hough.angularTolerance + 1e-9 + M_PI, hough.angleStep);
+ if(last - first >= hough.nbAngles)
+  last = first + hough.nbAngles - 1;
+
+ for(int k = first; k <= last; k++) {
+  int bucket = angleBucket(hough, k);
+  double u, w;
+  rotate(hough, bucket, middle, u, w);
+  int cuMax = cellCoord(u + marginU, HOUGHCELL);
+  int cwMin = cellCoord(w - marginW, hough.offsetStep);
+  int cwMax = cellCoord(w + marginW, hough.offsetStep);
+
+  for(int cu = cellCoord(u - marginU, HOUGHCELL); cu <= cuMax; cu++) {
+   for(int cw = cwMin; cw <= cwMax; cw++) {
+    auto it = hough.cells.find(cellKey(bucket, cu, cw));
+    if(it == hough.cells.end())
+     continue;
+
+    for(const HoughEntry &entry : it->second) {
+     if(entry.uMax >= u - marginU && entry.uMin <= u + marginU && hough.marks[entry.id] != hough.mark) {
+      hough.marks[entry.id] = hough.mark;
+      ids.push_back(entry.id);
+     }
+    }
+   }
+  }
+ }
+}
@@ -0,0 +1,30 @@
+#include <stdint.h>
+#include <vector>
+#include <unordered_map>
+#include <opencv2/opencv.hpp>
+
+#define HOUGHCELL 8000 // Millimeters
+#define HOUGHSLACK 4                                         // Troncatures de testLines() et arrondis, en millimètres
+#define HOUGHOFFSETCELL 2                                    // Largeur des mailles en distance perpendiculaire, en tolérances de distance
+
+typedef struct HoughEntry {
+ int id;
+ float uMin;                                                 // Étendue le long de la direction de la classe
+ float uMax;
+} HoughEntry;
+
+typedef struct HoughIndex {                                  // Segments classés par direction, puis en grille dans le repère tourné de leur classe
+ int nbAngles;
+ double angleStep;
+ std::vector<cv::Point2d> axes;                              // Direction du centre de chaque classe
+ double angularTolerance;
+ int distTolerance;
+ int offsetStep;
+ std::unordered_map<uint64_t, std::vector<HoughEntry>> cells;
+ std::vector<uint32_t> marks;
+ uint32_t mark;
+} HoughIndex;
+
+void clearHough(HoughIndex &hough, int distTolerance, double angularTolerance);
+void insertHough(HoughIndex &hough, int id, cv::Point a, cv::Point b);
+void queryHough(HoughIndex &hough, cv::Point a, cv::Point b, int lengthMargin, std::vector<int> &ids);
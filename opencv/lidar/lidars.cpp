@@ -1,140 +1,153 @@
-#include <wiringSerial.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <vector>
+#include "../common.hpp"
+#include "../session.hpp"
 #include "lidars.hpp"
 
+static LidarBuffer buffer = {};
+static LidarStats stats = {};
+
+static void setNonBlocking(int ld) {
+ fcntl(ld, F_SETFL, fcntl(ld, F_GETFL) | O_NONBLOCK);
+}
+
+static uint8_t bufferAt(uint32_t i) {
+ return buffer.data[(buffer.tail + i) & (LIDARBUFFERSIZE - 1)];
+}
+
+static void bufferCopy(uint8_t *packet, uint32_t size) {
+ uint32_t offset = buffer.tail & (LIDARBUFFERSIZE - 1);
+ uint32_t first = LIDARBUFFERSIZE - offset;
+
+ if(first >= size)
+  memcpy(packet, buffer.data + offset, size);
+ else {
+  memcpy(packet, buffer.data + offset, first);
+  memcpy(packet + first, buffer.data, size - first);
+ }
+}
+
+static bool fillBuffer(int ld) {
+ while(true) {
+  uint32_t offset = buffer.head & (LIDARBUFFERSIZE - 1);
+  uint32_t size = LIDARBUFFERSIZE - (buffer.head - buffer.tail);
+
+  if(!size)
+   return true;
+  if(size > LIDARBUFFERSIZE - offset)
+   size = LIDARBUFFERSIZE - offset;
+
+  int n = read(ld, buffer.data + offset, size);
+  stats.reads++;
+  if(n <= 0)
+   return false;
+
+  recordSession(SESSIONLIDAR, buffer.data + offset, n, NULL, 0);
+  buffer.head += n;
+  stats.bytes += n;
+
+  if(n < size)                                               // Le tampon du noyau est vide
+   return false;
+ }
+}
+
+#ifdef LIDARSTATSPERIOD
+static void reportStats() {
+ uint64_t now = getTimeNs(CLOCK_MONOTONIC);
+
+ if(!stats.start) {
+  stats.start = now;
+  return;
+ }
+
+ uint64_t elapsed = now - stats.start;
+ if(elapsed < uint64_t(LIDARSTATSPERIOD) * 1000000000)
+  return;
+
+ double seconds = double(elapsed) / 1000000000.0;
+ int cpuPerScan = 0;
+ if(stats.scans)
+  cpuPerScan = int(stats.cpuTime / 1000 / stats.scans);
+
+ fprintf(stderr, "Lidar %d bytes/s | %d reads/s | %d packets/s | %d errors | %d scans/s | %d dropped | %d us CPU/scan\n",
+         int(stats.bytes / seconds), int(stats.reads / seconds), int(stats.packets / seconds),
+         stats.errors, int(stats.scans / seconds), stats.dropped, cpuPerScan);
+
+ stats = {};
+ stats.start = now;
+}
+#endif
+
 #ifdef LDLIDAR
 void startLidar(int ld) {
+ setNonBlocking(ld);
 }
 
 void stopLidar(int ld) {
 }
 
-bool readLidar(int ld, std::vector<PolarPoint> &pointsOut) {
+static bool decodeLidar(std::vector<PolarPoint> &pointsOut) {
  static uint8_t waitMotor = WAITMOTOR;
- uint8_t current;
- static uint8_t n = 0;
- static uint8_t o = 0;
- static uint8_t p = 0;
- static uint16_t motorSpeed;
- static uint16_t startAngle;
- static uint16_t distances[NBMEASURESPACK];
- static uint8_t confidences[NBMEASURESPACK];
- static uint16_t endAngle;
- static uint16_t timestamp;
- static uint8_t crc = 0;
  static std::vector<PolarPoint> points;
  static uint16_t oldAngle = 0;
+ uint8_t packet[LDPACKETSIZE];
  bool done = false;
 
- while(serialDataAvail(ld)) {
-  current = serialGetchar(ld);
+ while(buffer.head - buffer.tail >= LDPACKETSIZE) {
+  if(bufferAt(0) != LDHEADER || bufferAt(1) != LDVERLEN) {
+   buffer.tail++;
+   continue;
+  }
 
-  if(n < 46)
-   crc = LDCRC[crc ^ current];
+  bufferCopy(packet, LDPACKETSIZE);
 
-  switch(n) {
+  uint8_t crc = 0;
+  for(uint8_t i = 0; i < LDPACKETSIZE - 1; i++)
+   crc = LDCRC[crc ^ packet[i]];
 
-   case 0:
-    if(current == 0x54)
-     n = 1;
-    break;
+  if(crc != packet[LDPACKETSIZE - 1]) {                      // Resynchroniser sur l'octet suivant
+   stats.errors++;
+   buffer.tail++;
+   continue;
+  }
 
-   case 1:
-    if(current == 0x2c)
-     n = 2;
-    else
-     n = 0;
-    break;
-
-   case 2:
-    motorSpeed = current;
-    n = 3;
-    break;
-
-   case 3:
-    motorSpeed |= current << 8;
-    n = 4;
-    break;
-
-   case 4:
-    startAngle = current;
-    n = 5;
-    break;
-
-   case 5:
-    startAngle |= current << 8;
-    n = 6;
-    break;
-
-   default:
-    switch(o) {
-     case 0:
-      distances[p] = current;
-      o = 1;
-      break;
-     case 1:
-      distances[p] |= current << 8;
-      o = 2;
-      break;
-     case 2:
-      confidences[p] = current;
-      o = 0;
-      p++;
-      break;
-    }
-    n++;
-    break;
-
-   case 42: // 6 + NBMEASURESPACK * 3
-    endAngle = current;
-    n = 43;
-    break;
-
-   case 43: {
-    endAngle |= current << 8;
-    n = 44;
-   } break;
-
-   case 44:
-    timestamp = current;
-    n = 45;
-    break;
-
-   case 45:
-    timestamp |= current << 8;
-    n = 46;
-    break;
-
-   case 46:
-    if(current == crc) {
-     uint16_t diff = (endAngle + 36000 - startAngle) % 36000;
-
-     for(uint8_t i = 0; i < NBMEASURESPACK; i++) {
-      if(distances[i] < DISTANCEMIN || confidences[i] < CONFIDENCEMIN)
-       continue;
-
-      uint16_t angle = startAngle + diff * i / (NBMEASURESPACK - 1);
-      angle = angle * 65536 / 36000;
-      points.push_back({distances[i], angle});
-
-      if(oldAngle > angle && !points.empty()) {
-       pointsOut = points;
-       points.clear();
-       if(waitMotor)
-        waitMotor--;
-       else
-        done = true;
-      }
-      oldAngle = angle;
-     }
-    }
+  buffer.tail += LDPACKETSIZE;
+  stats.packets++;
+
+  uint16_t startAngle = packet[4] | packet[5] << 8;
+  uint16_t endAngle = packet[42] | packet[43] << 8;          // 6 + NBMEASURESPACK * 3
+  uint16_t diff = (endAngle + 36000 - startAngle) % 36000;
+
+  for(uint8_t i = 0; i < NBMEASURESPACK; i++) {
+   uint8_t *measure = packet + 6 + i * 3;
+   uint16_t distance = measure[0] | measure[1] << 8;
+   uint8_t confidence = measure[2];
+
+   if(distance < DISTANCEMIN || confidence < CONFIDENCEMIN)
+    continue;
+
+   uint16_t angle = startAngle + diff * i / (NBMEASURESPACK - 1);
+   angle = uint32_t(angle) * 65536 / 36000;
 
-    n = 0;
-    p = 0;
-    crc = 0;
-    break;
+   if(oldAngle > angle && !points.empty()) {                 // Détection du passage par zéro
+    pointsOut.swap(points);
+    points.clear();
+    stats.scans++;
+    if(waitMotor)
+     waitMotor--;
+    else
+     done = true;
+   }
+   oldAngle = angle;
 
+   points.push_back({distance, angle});
   }
+
+  if(done)                                                   // La suite reste dans le tampon pour le prochain appel
+   break;
  }
 
  return done;
@@ -143,146 +156,141 @@ bool readLidar(int ld, std::vector<PolarPoint> &pointsOut) {
 
 #ifdef RPLIDAR
 void startLidar(int ld) {
- serialPutchar(ld, 0xa5);
- serialPutchar(ld, 0x82);
- serialPutchar(ld, 0x05);
- serialPutchar(ld, 0x00);
- serialPutchar(ld, 0x00);
- serialPutchar(ld, 0x00);
- serialPutchar(ld, 0x00);
- serialPutchar(ld, 0x00);
- serialPutchar(ld, 0x22);
+ const uint8_t request[] = {0xa5, 0x82, 0x05, 0x00, 0x00, 0x00, 0x00, 0x00, 0x22};
+
+ setNonBlocking(ld);
+ write(ld, request, sizeof(request));
 }
 
 void stopLidar(int ld) {
- serialPutchar(ld, 0xa5);
- serialPutchar(ld, 0x25);
+ const uint8_t request[] = {0xa5, 0x25};
+
+ write(ld, request, sizeof(request));
 }
 
-bool readLidar(int ld, std::vector<PolarPoint> &pointsOut) {
+static bool decodeLidar(std::vector<PolarPoint> &pointsOut) {
  static uint8_t init = 0;
- uint8_t current;
- static uint8_t n = 0;
- static uint8_t checksum;
- static uint8_t sum = 0;
- static uint16_t startAngleQ6;
  static uint16_t oldStartAngleQ6 = 0;
  static int32_t oldAngleBrutQ6 = 0;
  static uint8_t deltaAnglesQ3[NBMEASURESCABIN];
  static uint16_t distances[NBMEASURESCABIN];
- static uint8_t o = 0;
- static uint8_t p = 0;
- static uint16_t j = 0;
  static std::vector<PolarPoint> points;
+ uint8_t packet[CABINPACKETSIZE];
  bool done = false;
 
- while(serialDataAvail(ld)) {
-  current = serialGetchar(ld);
+ while(buffer.head - buffer.tail >= CABINPACKETSIZE) {
+  if(bufferAt(0) >> 4 != 0xA || bufferAt(1) >> 4 != 0x5) {  // Début de l'en-tête
+   buffer.tail++;
+   continue;
+  }
 
-  switch(n) {
+  bufferCopy(packet, CABINPACKETSIZE);
 
-   case 0:                                                   // Début de réception de l'en-tête
-    if(current >> 4 == 0xA) {
-     checksum = current & 0xF;
-     n = 1;
-    }
-    break;
-
-   case 1:
-    if(current >> 4 == 0x5) {
-     checksum |= current << 4;
-     n = 2;
-    } else
-     n = 0;
-    break;
-
-   case 2:
-    sum ^= current;
-    startAngleQ6 = current;
-    n = 3;
-    break;
-
-   case 3: {
-    sum ^= current;
-    startAngleQ6 |= (current & 0x7F) << 8;
-    //bool start = current >> 7;                             // Fin de réception de l'en-tête
-
-    if(init < NBINITS) {                                     // Ne pas calculer pendant la synchronisation ou sans les cabines
-     init++;
-     n = 4;
-     break;
-    }
+  uint8_t checksum = (packet[0] & 0xF) | packet[1] << 4;
+  uint8_t sum = 0;
+  for(uint8_t i = 2; i < CABINPACKETSIZE; i++)
+   sum ^= packet[i];
+
+  if(sum != checksum) {                                      // Resynchroniser sur l'octet suivant
+   stats.errors++;
+   init = NBINITS - 1;                                       // Ne pas faire les calculs pour les cabines précédentes
+   buffer.tail++;
+   continue;
+  }
 
-    uint16_t diffAngleQ6 = startAngleQ6 - oldStartAngleQ6;   // Calculer l'angle entre deux mesures de référence
-    if(oldStartAngleQ6 > startAngleQ6)
-     diffAngleQ6 += FULLTURNQ6;
+  buffer.tail += CABINPACKETSIZE;
+  stats.packets++;
 
-    int32_t diffAngleTotalQ6 = 0;
-    for(uint8_t i = 0; i < NBMEASURESCABIN; i++) {
+  uint16_t startAngleQ6 = packet[2] | (packet[3] & 0x7F) << 8;
+  //bool start = packet[3] >> 7;                             // Fin de l'en-tête
 
-     // Calculer l'angle non compensé
-     int32_t angleBrutQ6 = (oldStartAngleQ6 + diffAngleTotalQ6 / NBMEASURESCABIN) % FULLTURNQ6;
-     diffAngleTotalQ6 += diffAngleQ6;
+  if(init < NBINITS)                                         // Ne pas calculer pendant la synchronisation ou sans les cabines
+   init++;
+  else {
+   uint16_t diffAngleQ6 = startAngleQ6 - oldStartAngleQ6;   // Calculer l'angle entre deux mesures de référence
+   if(oldStartAngleQ6 > startAngleQ6)
+    diffAngleQ6 += FULLTURNQ6;
 
-     if(oldAngleBrutQ6 > angleBrutQ6 && !points.empty()) {   // Détection du passage par zéro de l'angle non compensé
-      pointsOut = points;
-      points.clear();
-      done = true;
-     }
-     oldAngleBrutQ6 = angleBrutQ6;
+   int32_t diffAngleTotalQ6 = 0;
+   for(uint8_t i = 0; i < NBMEASURESCABIN; i++) {
 
-     if(distances[i] >= DISTANCEMIN) {                       // Si la lecture est valide
-      int32_t angle = angleBrutQ6 - (deltaAnglesQ3[i] << 3); // Calculer l'angle compensé
-      angle = angle * 65536 / FULLTURNQ6;                    // Remise à l'échelle de l'angle
-      points.push_back({distances[i], uint16_t(angle)});
-     }
+    // Calculer l'angle non compensé
+    int32_t angleBrutQ6 = (oldStartAngleQ6 + diffAngleTotalQ6 / NBMEASURESCABIN) % FULLTURNQ6;
+    diffAngleTotalQ6 += diffAngleQ6;
 
+    if(oldAngleBrutQ6 > angleBrutQ6 && !points.empty()) {   // Détection du passage par zéro de l'angle non compensé
+     pointsOut.swap(points);
+     points.clear();
+     stats.scans++;
+     done = true;
     }
-    oldStartAngleQ6 = startAngleQ6;
-
-    n = 4;
-   } break;
-
-   default:                                                  // Début de réception des cabines
-    sum ^= current;
-    switch(o) {
-     case 0:
-      deltaAnglesQ3[p] = (current & 0b11) << 4;
-      distances[p] = current >> 2;
-      o = 1;
-      break;
-     case 1:
-      distances[p] |= current << 6;
-      o = 2;
-      break;
-     case 2:
-      deltaAnglesQ3[p + 1] = (current & 0b11) << 4;
-      distances[p + 1] = current >> 2;
-      o = 3;
-      break;
-     case 3:
-      distances[p + 1] |= current << 6;
-      o = 4;
-      break;
-     case 4:
-      deltaAnglesQ3[p] |= current & 0b1111;
-      deltaAnglesQ3[p + 1] |= current >> 4;
-      o = 0;
-      p += 2;
-      if(p == NBMEASURESCABIN) {
-       if(sum != checksum)
-        init = NBINITS - 1;                                  // Ne pas faire les calculs pour ces cabines
-       n = 0;
-       p = 0;
-       sum = 0;
-      }
-      break;
+    oldAngleBrutQ6 = angleBrutQ6;
+
+    if(distances[i] >= DISTANCEMIN) {                        // Si la lecture est valide
+     int32_t angle = angleBrutQ6 - (deltaAnglesQ3[i] << 3);  // Calculer l'angle compensé
+     angle = angle * 65536 / FULLTURNQ6;                     // Remise à l'échelle de l'angle
+     points.push_back({distances[i], uint16_t(angle)});
     }
-    break;
 
+   }
+  }
+  oldStartAngleQ6 = startAngleQ6;
+
+  for(uint8_t p = 0; p < NBMEASURESCABIN; p += 2) {         // Décodage des cabines
+   uint8_t *cabin = packet + 4 + p / 2 * 5;
+
+   distances[p] = cabin[0] >> 2 | cabin[1] << 6;
+   distances[p + 1] = cabin[2] >> 2 | cabin[3] << 6;
+   deltaAnglesQ3[p] = (cabin[0] & 0b11) << 4 | cabin[4] & 0b1111;
+   deltaAnglesQ3[p + 1] = (cabin[2] & 0b11) << 4 | cabin[4] >> 4;
   }
+
+  if(done)                                                   // La suite reste dans le tampon pour le prochain appel
+   break;
  }
 
  return done;
 }
 #endif
+
+bool readLidar(int ld, std::vector<PolarPoint> &pointsOut) {
+ bool done = false;
+ bool full;
+
+#ifdef LIDARSTATSPERIOD
+ uint64_t cpuStart = getTimeNs(CLOCK_THREAD_CPUTIME_ID);
+#endif
+
+ do {                                                        // Vider le port série par gros blocs, un scan complet au plus
+  full = fillBuffer(ld);
+  done = decodeLidar(pointsOut);
+ } while(full && !done);
+
+#ifdef LIDARSTATSPERIOD
+ stats.cpuTime += getTimeNs(CLOCK_THREAD_CPUTIME_ID) - cpuStart;
+ reportStats();
+#endif
+
+ return done;
+}
+
+void publishScan(LidarScans &scans) {
+ uint8_t old = scans.middle.exchange(scans.back | SCANFRESH, std::memory_order_acq_rel);
+
+ if(old & SCANFRESH) {                                       // Le consommateur n'a pas pris le scan précédent
+  scans.dropped++;
+  stats.dropped++;
+ }
+
+ scans.back = old & ~SCANFRESH;
+}
+
+bool consumeScan(LidarScans &scans) {
+ if(!(scans.middle.load(std::memory_order_acquire) & SCANFRESH))
+  return false;
+
+ uint8_t old = scans.middle.exchange(scans.front, std::memory_order_acq_rel);
+ scans.front = old & ~SCANFRESH;
+
+ return true;
+}
@@ -1,10 +1,21 @@
 #include <stdint.h>
+#include <vector>
+#include <atomic>
 
 #define LIDARPORT "/dev/serial0"
 
+#define LIDARBUFFERSIZE 4096 // Power of two
+#define LIDARSTATSPERIOD 10  // Seconds, comment to disable the statistics
+#define LIDARPOLLTIMEOUT 100 // Milliseconds
+#define NBSCANS 3
+#define SCANFRESH 0x80
+
 #define LDLIDAR
 #define LIDARRATE 230400
 #define WAITMOTOR 5
+#define LDHEADER 0x54
+#define LDVERLEN 0x2c
+#define LDPACKETSIZE 47
 #define NBMEASURESPACK 12
 #define DISTANCEMIN 50
 #define CONFIDENCEMIN 10
@@ -12,6 +23,7 @@
 //#define RPLIDAR
 //#define LIDARRATE 115200
 //#define NBINITS 3
+//#define CABINPACKETSIZE 84
 //#define NBMEASURESCABIN 32
 //#define FULLTURNQ6 (360 << 6)
 //#define DISTANCEMIN 100
@@ -56,6 +68,38 @@ typedef struct PolarPoint {
  uint16_t theta;
 } PolarPoint;
 
+typedef struct LidarBuffer {
+ uint8_t data[LIDARBUFFERSIZE];
+ uint32_t head;
+ uint32_t tail;
+} LidarBuffer;
+
+typedef struct LidarStats {
+ uint64_t start;
+ uint64_t cpuTime;
+ uint32_t bytes;
+ uint32_t reads;
+ uint32_t packets;
+ uint32_t errors;
+ uint32_t scans;
+ uint32_t dropped;
+} LidarStats;
+
+typedef struct LidarScan {
+ std::vector<PolarPoint> points;
+ uint64_t timestamp;
+} LidarScan;
+
+typedef struct LidarScans {                                  // Triple tampon producteur unique / consommateur unique
+ LidarScan scans[NBSCANS];
+ uint8_t back = 0;                                           // Propriété du producteur
+ std::atomic<uint8_t> middle{1};                             // Index échangé, SCANFRESH si non consommé
+ uint8_t front = 2;                                          // Propriété du consommateur
+ std::atomic<uint32_t> dropped{0};
+} LidarScans;
+
 void startLidar(int ld);
 void stopLidar(int ld);
 bool readLidar(int ld, std::vector<PolarPoint> &pointsOut);
+void publishScan(LidarScans &scans);
+bool consumeScan(LidarScans &scans);
@@ -1,15 +1,35 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <opencv2/opencv.hpp>
 #include <opencv2/videoio.hpp>
 #include <wiringSerial.h>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <atomic>
+#include <iterator>
+#include <deque>
 #include <RTIMULib.h>
 #include "../common.hpp"
 #include "../frame.hpp"
+#include "../loop.hpp"
+#include "../capture.hpp"
+#include "../session.hpp"
+#include "../output.hpp"
+#include "../draw.hpp"
 #include "lidars.hpp"
 #include "sin16.hpp"
+#include "points.hpp"
+#include "mapindex.hpp"
+#include "hough.hpp"
+#include "field.hpp"
+#include "reloc.hpp"
+#include "graph.hpp"
 #include "main.hpp"
 
 using namespace std;
@@ -42,13 +62,103 @@ void imuThread() {
 
  while(run) {
   usleep(imu->IMUGetPollInterval() * 1000);
-  while(imu->IMURead())
+  while(imu->IMURead()) {
    imuData = imu->getIMUData();
+
+   if(recording()) {
+    float pose[3] = {imuData.fusionPose.x(), imuData.fusionPose.y(), imuData.fusionPose.z()};
+    recordSession(SESSIONIMU, pose, sizeof(pose), NULL, 0);
+   }
+  }
  }
 
  fprintf(stderr, "IMU thread stopping\n");
 }
 
+void lidarThread(int ld) {
+ fprintf(stderr, "Lidar thread starting\n");
+
+ struct pollfd pollLidar = {ld, POLLIN, 0};
+ startLidar(ld);
+
+ while(run) {
+  if(poll(&pollLidar, 1, LIDARPOLLTIMEOUT) <= 0)
+   continue;
+
+  while(true) {                                              // Le tampon peut encore contenir un scan complet
+   LidarScan &scan = lidarScans.scans[lidarScans.back];
+   if(!readLidar(ld, scan.points))
+    break;
+
+   scan.timestamp = getTimeNs(CLOCK_MONOTONIC);
+   publishScan(lidarScans);
+   writeEvent(lidarEvent);
+  }
+ }
+
+ stopLidar(ld);
+ fprintf(stderr, "Lidar thread stopping\n");
+}
+
+bool replayRecord(uint8_t type, const uint8_t *data, uint32_t size) {
+ switch(type) {
+
+  case SESSIONLIDAR: {                                       // Décodage par readLidar() comme sur le port série
+   write(replayLidar[1], data, size);
+
+   while(true) {                                             // Un enregistrement peut terminer plusieurs scans
+    LidarScan &scan = lidarScans.scans[lidarScans.back];
+    if(!readLidar(replayLidar[0], scan.points))
+     break;
+
+    scan.timestamp = getTimeNs(CLOCK_MONOTONIC);
+    publishScan(lidarScans);
+    writeEvent(lidarEvent);
+    if(replayFast)                                           // Attendre la fin du traitement du scan
+     readEvent(replayEvent);
+   }
+  } break;
+
+  case SESSIONIMU: {
+   const float *pose = (const float *) data;
+   imuData.fusionPose.setX(pose[0]);
+   imuData.fusionPose.setY(pose[1]);
+   imuData.fusionPose.setZ(pose[2]);
+  } break;
+
+  case SESSIONREMOTE:                                        // Décodage par readModem() comme sur le port série
+   write(replayModem[1], data, size);
+   break;
+
+  case SESSIONCAMERA: {
+   const SessionCamera *camera = (const SessionCamera *) data;
+   if(camera->width == width && camera->height == height &&
+      size == sizeof(SessionCamera) + imageSize(width, height, yuv)) {
+    lock_guard<mutex> lock(replayMutex);
+    replayImage = data + sizeof(SessionCamera);
+   }
+  } break;
+
+  case SESSIONEND: {
+   lock_guard<mutex> lock(replayMutex);
+   replayImage = NULL;
+  } break;
+
+ }
+
+ return run;
+}
+
+void replayThread(const char *path) {
+ fprintf(stderr, "Replay thread starting\n");
+
+ startLidar(replayLidar[0]);
+ replaySession(path, replayFast, replayRecord);
+ run = false;
+
+ fprintf(stderr, "Replay thread stopping\n");
+}
+
 int sqNorm(Point point) {
  return point.x * point.x + point.y * point.y;
 }
@@ -149,34 +259,116 @@ void extractRawLinesMike118(vector<PolarPoint> &polarPoints, vector<Point> &robo
  }
 }
 
+void appendLineFit(LineFit &fit, Point point) {
+ if(!fit.n) {
+  fit.origin = point;                                        // Moments relatifs au premier point pour la précision
+  fit.first = point;
+ }
+ fit.last = point;
+
+ double x = point.x - fit.origin.x;
+ double y = point.y - fit.origin.y;
+ fit.n++;
+ fit.sx += x;
+ fit.sy += y;
+ fit.sxx += x * x;
+ fit.syy += y * y;
+ fit.sxy += x * y;
+}
+
+double lineFitAxis(LineFit &fit, Point2d &mean, Point2d &dir) {
+ mean = Point2d(fit.sx / fit.n, fit.sy / fit.n);
+ double cxx = fit.sxx / fit.n - mean.x * mean.x;
+ double cyy = fit.syy / fit.n - mean.y * mean.y;
+ double cxy = fit.sxy / fit.n - mean.x * mean.y;
+
+ double half = (cxx - cyy) / 2.0;                            // Valeurs propres de la covariance
+ double root = sqrt(half * half + cxy * cxy);
+ double lambdaMax = (cxx + cyy) / 2.0 + root;
+ double lambdaMin = (cxx + cyy) / 2.0 - root;
+
+ Point2d dir1 = Point2d(lambdaMax - cyy, cxy);               // Vecteur propre du grand axe, la plus stable des deux formes
+ Point2d dir2 = Point2d(cxy, lambdaMax - cxx);
+ dir = dir1.dot(dir1) >= dir2.dot(dir2) ? dir1 : dir2;
+ double norm = sqrt(dir.dot(dir));
+ if(norm > 0.0)
+  dir = dir / norm;
+ else
+  dir = Point2d(1.0, 0.0);
+
+ return sqrt(max(lambdaMin, 0.0));                           // Résidu orthogonal quadratique moyen
+}
+
+double lineFitDist(LineFit &fit, Point point) {
+ Point2d mean;
+ Point2d dir;
+ lineFitAxis(fit, mean, dir);
+
+ Point2d diff = Point2d(point - fit.origin) - mean;
+ return fabs(diff.y * dir.x - diff.x * dir.y);
+}
+
+void closeLineFit(LineFit &fit, vector<Line> &linesOut) {
+ if(fit.n >= NBPOINTSMIN && sqDist(fit.first, fit.last) >= LIDARLINESMINLEN * LIDARLINESMINLEN) {
+  Point2d mean;
+  Point2d dir;
+  double residual = lineFitAxis(fit, mean, dir);
+  Point2d first = Point2d(fit.first - fit.origin) - mean;
+  Point2d last = Point2d(fit.last - fit.origin) - mean;
+
+  Point2d a = mean + dir * first.dot(dir);                   // Projection des extrémités sur la droite ajustée
+  Point2d b = mean + dir * last.dot(dir);
+  Line line = {fit.origin + Point(int(lround(a.x)), int(lround(a.y))),
+               fit.origin + Point(int(lround(b.x)), int(lround(b.y)))};
+  line.residual = int(lround(residual));
+  linesOut.push_back(line);
+ }
+
+ fit = {};
+}
+
 void fitLines(vector<vector<Point>> &rawLinesIn, vector<Line> &linesOut) {
  for(int i = 0; i < rawLinesIn.size(); i++) {
-  vector<double> fit;
-  fitLine(rawLinesIn[i], fit, CV_DIST_L2, 0.0, 0.01, 0.01);
+  LineFit fit = {};
+  for(int j = 0; j < rawLinesIn[i].size(); j++)
+   appendLineFit(fit, rawLinesIn[i][j]);
+  closeLineFit(fit, linesOut);
+ }
+}
+
+void extractLinesStreaming(vector<PolarPoint> &polarPoints, vector<Point> &robotPoints, vector<Line> &robotLines) {
+ int size = robotPoints.size();
+ if(size < NBPOINTSMIN)
+  return;
 
-  Point point0 = Point(fit[2], fit[3]);
+ uint16_t angle = 2 * PI16 / size;
+ int sinAngle = sin16(angle);
+ LineFit fit = {};
+ int firstBreak = 0;                                         // Le segment ouvert au début est repris en fin de tour
 
-  double dist1 = sqrt(sqDist(point0, rawLinesIn[i][0]));
-  double dist2 = sqrt(sqDist(point0, rawLinesIn[i][rawLinesIn[i].size() - 1]));
+ for(int i = 1; i < size + max(firstBreak, 1); i++) {
+  int ii = i % size;
+  Point point = robotPoints[ii];
 
-  Point point1 = Point(fit[0] * dist1 + fit[2],
-                       fit[1] * dist1 + fit[3]);
+  int distMax = polarPoints[ii].distance * sinAngle * DISTCOEF / ONE16;
+  if(distMax < DISTCLAMP)
+   distMax = DISTCLAMP;
 
-  int sqDist3 = sqDist(point1, rawLinesIn[i][0]);
-  int sqDist4 = sqDist(point1, rawLinesIn[i][rawLinesIn[i].size() - 1]);
+  bool gap = sqDist(point, robotPoints[(i - 1) % size]) >= distMax * distMax;
+  bool corner = fit.n >= NBPOINTSMIN && lineFitDist(fit, point) > EPSILON;
 
-  Point point2;
-  if(sqDist3 > sqDist4) {
-   point1 = Point(fit[0] * -dist1 + fit[2],
-                  fit[1] * -dist1 + fit[3]);
-   point2 = Point(fit[0] * dist2 + fit[2],
-                  fit[1] * dist2 + fit[3]);
-  } else
-   point2 = Point(fit[0] * -dist2 + fit[2],
-                  fit[1] * -dist2 + fit[3]);
+  if(gap || corner) {
+   if(!firstBreak) {
+    firstBreak = i;
+    fit = {};
+   } else
+    closeLineFit(fit, robotLines);
+  }
 
-  linesOut.push_back({point1, point2});
+  appendLineFit(fit, point);
  }
+
+ closeLineFit(fit, robotLines);
 }
 
 void lidarToRobot(vector<PolarPoint> &pointsIn, vector<Point> &pointsOut) {
@@ -203,12 +395,14 @@ Point rotate(Point point, uint16_t theta) {
 void robotToMap(Line lineIn, Line &lineOut, Point robotPoint, uint16_t robotTheta) {
  lineOut = {robotPoint + rotate(lineIn.a, robotTheta),
             robotPoint + rotate(lineIn.b, robotTheta)};
+ lineOut.residual = lineIn.residual;
 }
 
 void robotToMap(vector<Line> &linesIn, vector<Line> &linesOut, Point robotPoint, uint16_t robotTheta) {
  for(int i = 0; i < linesIn.size(); i++) {
-  linesOut.push_back({robotPoint + rotate(linesIn[i].a, robotTheta),
-                      robotPoint + rotate(linesIn[i].b, robotTheta)});
+  Line line;
+  robotToMap(linesIn[i], line, robotPoint, robotTheta);
+  linesOut.push_back(line);
  }
 }
 
@@ -287,7 +481,7 @@ Point pointDistancePointLine(Point point, Line line) {
  Point diff = line.b - line.a;
  Point result = Point(0, 0);
 
- if(ratio) {
+ if(diff.x || diff.y) {                                      // Un point projeté sur line.a reste à sa distance de la droite
   h.x = line.a.x + int(double(diff.x) * ratio);
   h.y = line.a.y + int(double(diff.y) * ratio);
   result = point - h;
@@ -421,86 +615,357 @@ void sortLines(vector<Line> &lines) {
  });
 }
 
-void mapCleaner(vector<PolarPoint> &polarPoints, vector<Line> &map, Point robotPoint, uint16_t robotTheta) {
- vector<Point> closerPoints;
- bool sort = false;
+void buildIndex(MapIndex &index, const vector<Line> &map) {
+ clearIndex(index);
+ for(int i = 0; i < map.size(); i++)
+  insertIndex(index, i, map[i].a, map[i].b);
+}
+
+void buildOrderedIndex(MapIndex &index, vector<int> &order, const vector<Line> &map) { // Identifiants par longueur décroissante, l'ordre de parcours de computeErrors()
+ order.resize(map.size());
+ for(int i = 0; i < map.size(); i++)
+  order[i] = i;
+ stable_sort(order.begin(), order.end(), [&map](int a, int b) {
+  return sqDist(map[a]) > sqDist(map[b]);
+ });
+
+ clearIndex(index);
+ for(int i = 0; i < order.size(); i++)
+  insertIndex(index, i, map[order[i]].a, map[order[i]].b);
+}
+
+bool restingLine(Line line) {                                 // Plus rien à faire tant qu'elle n'est pas modifiée
+ return line.validation >= VALIDATIONFILTERKEEP &&
+        line.shrinka == SHRINKFILTER && line.shrinkb == SHRINKFILTER &&
+        sqDist(line) >= MAPLINESMINLEN * MAPLINESMINLEN;
+}
+
+void openLineMap(LineMap &map, vector<Line> &lines) {
+ map.lines.swap(lines);
+ map.erased.assign(map.lines.size(), false);
+ map.dirty.resize(map.lines.size());
+ map.touched.clear();
+ map.maintaining = false;
+ map.maxLength = 0;
+ map.stale = 0;
+
+ for(int i = 0; i < map.lines.size(); i++) {
+  map.dirty[i] = map.lines[i].settled ? LINECLEAN : LINEDIRTY;
+  if(map.dirty[i] != LINECLEAN)
+   map.touched.push_back(i);
+  map.maxLength = max(map.maxLength, int(sqrt(sqDist(map.lines[i]))) + 1);
+ }
+
+ buildIndex(map.index, map.lines);
+}
+
+void addLine(LineMap &map, Line line) {
+ map.lines.push_back(line);
+ map.erased.push_back(false);
+ map.dirty.push_back(map.maintaining ? LINECARRIED : LINEDIRTY);
+ map.touched.push_back(map.lines.size() - 1);
+ map.maxLength = max(map.maxLength, int(sqrt(sqDist(line))) + 1);
+ insertIndex(map.index, map.lines.size() - 1, line.a, line.b);
+}
+
+void touchLine(LineMap &map, int i) {                         // À appeler après chaque modification de la ligne i
+ if(map.dirty[i] == LINECLEAN)
+  map.touched.push_back(i);
+ if(map.dirty[i] != LINECARRIED)
+  map.dirty[i] = map.maintaining ? LINECARRIED : LINEDIRTY;
+ map.maxLength = max(map.maxLength, int(sqrt(sqDist(map.lines[i]))) + 1);
+ insertIndex(map.index, i, map.lines[i].a, map.lines[i].b);
+ map.stale++;
+}
+
+void eraseLine(LineMap &map, int i) {
+ if(!map.erased[i])
+  map.stale++;
+ map.erased[i] = true;
+}
+
+void settleLineMap(LineMap &map) {                           // Fin du scan, seules les lignes hors de LINECLEAN sont revues
+ vector<int> touched;
+ for(int i : map.touched) {
+  if(map.erased[i])
+   continue;
+
+  map.lines[i].settled = map.dirty[i] == LINEDIRTY && restingLine(map.lines[i]);
+  map.dirty[i] = map.lines[i].settled ? LINECLEAN : LINEDIRTY;
+  if(!map.lines[i].settled)
+   touched.push_back(i);
+ }
+ sort(touched.begin(), touched.end());                       // Même ordre qu'après une réouverture
+ map.touched.swap(touched);
+ map.maintaining = false;
+}
+
+void packLineMap(const LineMap &map, vector<Line> &lines) {  // Survivantes dans l'ordre des emplacements
+ lines.clear();
+ lines.reserve(map.lines.size() - count(map.erased.begin(), map.erased.end(), true));
+ for(int i = 0; i < map.lines.size(); i++) {
+  if(!map.erased[i])
+   lines.push_back(map.lines[i]);
+ }
+}
+
+bool compactLineMap(LineMap &map) {                          // Seulement quand les emplacements périmés dépassent le nombre de lignes
+ if(map.stale < max(int(map.lines.size()), MAPCOMPACTMIN))
+  return false;
+
+ vector<Line> lines;
+ packLineMap(map, lines);
+ openLineMap(map, lines);
+ return true;
+}
+
+void closeLineMap(LineMap &map, vector<Line> &lines) {
+ settleLineMap(map);
+ packLineMap(map, lines);
+ map.lines.clear();
+ map.erased.clear();
+ map.dirty.clear();
+ map.touched.clear();
+ clearIndex(map.index);
+}
+
+int lineMargin(Line line, int distTolerance) {              // Une ligne acceptée par testLines() passe à moins de cette distance
+ return distTolerance + int(sqrt(sqDist(line))) / 2 + 2;
+}
+
+void queryLine(MapIndex &index, Line line, int margin, vector<int> &ids) {
+ startQuery(index, ids);
+ queryIndex(index, Point(min(line.a.x, line.b.x) - margin, min(line.a.y, line.b.y) - margin),
+                   Point(max(line.a.x, line.b.x) + margin, max(line.a.y, line.b.y) + margin), ids);
+}
+
+void queryEnds(MapIndex &index, Line line, int margin, vector<int> &ids) {
+ startQuery(index, ids);
+ queryIndex(index, line.a - Point(margin, margin), line.a + Point(margin, margin), ids);
+ queryIndex(index, line.b - Point(margin, margin), line.b + Point(margin, margin), ids);
+}
+
+// Lignes modifiées dans work, puis dans anchors avec toutes les lignes dont la boîte passe à moins de margin
+// de l'une d'elles, par longueur décroissante comme la carte triée d'origine. Une paire de lignes propres a déjà été traitée.
+void dirtyLines(LineMap &map, int margin, vector<bool> &work, vector<int> &anchors) {
+ vector<int> candidates;
+ work.assign(map.lines.size(), false);
+ anchors.clear();
+ for(int i : map.touched) {
+  if(!map.erased[i]) {
+   work[i] = true;
+   anchors.push_back(i);
+  }
+ }
+
+ vector<bool> listed = work;
+ int nbDirty = anchors.size();
+ for(int k = 0; k < nbDirty; k++) {
+  queryLine(map.index, map.lines[anchors[k]], margin, candidates);
+  for(int j : candidates) {
+   if(!listed[j] && !map.erased[j]) {
+    listed[j] = true;
+    anchors.push_back(j);
+   }
+  }
+ }
+ sort(anchors.begin(), anchors.end(), [&map](int a, int b) {
+  int lengthA = sqDist(map.lines[a]);
+  int lengthB = sqDist(map.lines[b]);
+  return lengthA > lengthB || lengthA == lengthB && a < b;
+ });
+}
+
+void rankLines(const LineMap &map, const vector<int> &anchors, vector<int> &ranks) { // Une paire n'est testée que depuis la plus longue
+ ranks.assign(map.lines.size(), -1);
+ for(int k = 0; k < anchors.size(); k++)
+  ranks[anchors[k]] = k;
+}
+
+void sortRanks(const vector<int> &ranks, vector<int> &ids) {     // Même ordre de parcours que la boucle complète sur la carte triée
+ sort(ids.begin(), ids.end(), [&ranks](int a, int b) {
+  return ranks[a] < ranks[b];
+ });
+}
+
+int reverseMargin(LineMap &map, int distTolerance, double angularTolerance) { // Une ligne acceptée par testLines() avec une marge de longueur négative passe à moins de cette distance de la ligne testée
+ return distTolerance + HOUGHSLACK + int(map.maxLength / 2 * sin(min(angularTolerance, M_PI / 2.0))) + 1;
+}
+
+#ifdef MAPCLEANERSTATSPERIOD
+void reportMapCleanerStats() {
+ uint64_t now = getTimeNs(CLOCK_MONOTONIC);
+
+ if(!mapCleanerStats.start) {
+  mapCleanerStats.start = now;
+  return;
+ }
+
+ if(now - mapCleanerStats.start < uint64_t(MAPCLEANERSTATSPERIOD) * 1000000000)
+  return;
+
+ if(mapCleanerStats.rays && mapCleanerStats.cpuTime)
+  fprintf(stderr, "Map cleaner | %d rays/s | %.1f lines/ray out of %d\n",
+          int(mapCleanerStats.rays * 1000000000 / mapCleanerStats.cpuTime),
+          double(mapCleanerStats.tests) / mapCleanerStats.rays, int(mapCleanerStats.lines / mapCleanerStats.scans));
+
+ mapCleanerStats = {};
+ mapCleanerStats.start = now;
+}
+#endif
+
+void queryThickRay(MapIndex &index, Line ray, vector<int> &ids) { // Bords du rayon épaissi, l'arrondi de intersect() ne perd aucune ligne
+ Point2d a = ray.a;
+ Point2d b = ray.b;
+ Point2d dir = b - a;
+ dir = dir / sqrt(dir.dot(dir));
+ Point2d normal = Point2d(-dir.y, dir.x) * MAPCLEANERRAYMARGIN;
+ a -= dir * MAPCLEANERRAYMARGIN;
+ b += dir * MAPCLEANERRAYMARGIN;
+
+ startQuery(index, ids);
+ queryRay(index, a + normal, b + normal, ids);
+ queryRay(index, a - normal, b - normal, ids);
+}
+
+void mapCleaner(vector<PolarPoint> &polarPoints, LineMap &map, Point robotPoint, uint16_t robotTheta) {
+ vector<Line> &lines = map.lines;
+ vector<Line> rays;
+ vector<double> rayAngles;
+ vector<int> candidates;
+ vector<Pair> hits;                                          // Paires (ligne, rayon) candidates, sans parcourir toute la carte
+#ifdef MAPCLEANERSTATSPERIOD
+ uint64_t cpuStart = getTimeNs(CLOCK_THREAD_CPUTIME_ID);
+#endif
 
  for(int i = 0; i < polarPoints.size(); i++) {
   Point closerPoint = Point((polarPoints[i].distance * MAPCLEANERDISTPERCENT / 100) * sin16(polarPoints[i].theta) / ONE16,
                             (polarPoints[i].distance * MAPCLEANERDISTPERCENT / 100) * cos16(polarPoints[i].theta) / ONE16);
 
-  closerPoints.push_back(robotPoint + rotate(closerPoint, robotTheta));
+  Line shorterLine = {robotPoint, robotPoint + rotate(closerPoint, robotTheta)};
+  if(shorterLine.a == shorterLine.b)                         // Aucune intersection possible
+   continue;
+
+  rays.push_back(shorterLine);
+  rayAngles.push_back(lineAngle(shorterLine));
  }
 
- for(int i = 0; i < map.size(); i++) {
+ for(int j = 0; j < rays.size(); j++) {
+  queryThickRay(map.index, rays[j], candidates);
+  for(int k = 0; k < candidates.size(); k++) {
+   if(!map.erased[candidates[k]])
+    hits.push_back({candidates[k], j});
+  }
+ }
+ sort(hits.begin(), hits.end());                             // Lignes dans l'ordre des emplacements, rayons dans l'ordre du scan
+
+ int tests = 0;
+ for(int first = 0; first < hits.size();) {
+  int i = hits[first].first;
+  int last = first + 1;
+  while(last < hits.size() && hits[last].first == i)
+   last++;
+
   bool shrinka = true;
   bool shrinkb = true;
+  double angle = lineAngle(lines[i]);
+  Line before = lines[i];
 
-  for(int j = 0; j < closerPoints.size(); j++) {
-   Line shorterLine = {robotPoint, closerPoints[j]};
+  for(int k = first; k < last; k++) {
+   int j = hits[k].second;
+   tests++;
 
-   double angularError = diffAngle(map[i], shorterLine);
+   double angularError = diffAngle(angle, rayAngles[j]);
    if(angularError < MAPCLEANERANGULARTOLERANCE || angularError > M_PI - MAPCLEANERANGULARTOLERANCE)
     continue;
 
    Point intersectPoint;
-   if(!intersect(shorterLine, map[i], intersectPoint))
+   if(!intersect(rays[j], lines[i], intersectPoint))
     continue;
 
-   if(sqDist(map[i].a, intersectPoint) < sqDist(map[i].b, intersectPoint)) {
+   if(sqDist(lines[i].a, intersectPoint) < sqDist(lines[i].b, intersectPoint)) {
     if(shrinka) {
      shrinka = false;
-     map[i].shrinka--;
+     lines[i].shrinka--;
     }
-    if(map[i].shrinka == 0) {
-     map[i].a = intersectPoint;
-     sort = true;
+    if(lines[i].shrinka == 0) {
+     lines[i].a = intersectPoint;
+     angle = lineAngle(lines[i]);
     }
    } else {
     if(shrinkb) {
      shrinkb = false;
-     map[i].shrinkb--;
+     lines[i].shrinkb--;
     }
-    if(map[i].shrinkb == 0) {
-     map[i].b = intersectPoint;
-     sort = true;
+    if(lines[i].shrinkb == 0) {
+     lines[i].b = intersectPoint;
+     angle = lineAngle(lines[i]);
     }
    }
 
-   if(sqDist(map[i]) < MAPLINESMINLEN * MAPLINESMINLEN) {
-    map.erase(map.begin() + i);
-    i--;
+   if(sqDist(lines[i]) < MAPLINESMINLEN * MAPLINESMINLEN) {
+    eraseLine(map, i);
+    break;
    }
   }
 
-  if(map[i].shrinka == 0)
-   map[i].shrinka = SHRINKFILTER;
-  if(map[i].shrinkb == 0)
-   map[i].shrinkb = SHRINKFILTER;
+  if(lines[i].shrinka == 0)
+   lines[i].shrinka = SHRINKFILTER;
+  if(lines[i].shrinkb == 0)
+   lines[i].shrinkb = SHRINKFILTER;
+
+  if(!map.erased[i] && (lines[i].a != before.a || lines[i].b != before.b ||
+                        lines[i].shrinka != before.shrinka || lines[i].shrinkb != before.shrinkb))
+   touchLine(map, i);
+  first = last;
  }
 
- if(sort)
-  sortLines(map);
+#ifdef MAPCLEANERSTATSPERIOD
+ mapCleanerStats.cpuTime += getTimeNs(CLOCK_THREAD_CPUTIME_ID) - cpuStart;
+ mapCleanerStats.rays += rays.size();
+ mapCleanerStats.tests += tests;
+ mapCleanerStats.lines += lines.size();
+ mapCleanerStats.scans++;
+ reportMapCleanerStats();
+#endif
+}
+
+void buildHough(HoughIndex &hough, const LineMap &map, const vector<int> &ids, int distTolerance, double angularTolerance) {
+ clearHough(hough, distTolerance, angularTolerance);
+ for(int i : ids)
+  insertHough(hough, i, map.lines[i].a, map.lines[i].b);
 }
 
-void mapDeduplicateAverage(vector<Line> &map) {
- bool sort = false;
+void mapDeduplicateAverage(LineMap &map) {                    // Seules les paires dont une ligne a été modifiée sont testées
+ vector<Line> &lines = map.lines;
+ HoughIndex hough;
+ vector<bool> work;
+ vector<int> anchors;
+ vector<int> ranks;
+ vector<int> candidates;
+ map.maintaining = true;
+ dirtyLines(map, reverseMargin(map, SMALLDISTTOLERANCE, SMALLANGULARTOLERANCE), work, anchors);
+ rankLines(map, anchors, ranks);
+ buildHough(hough, map, anchors, SMALLDISTTOLERANCE, SMALLANGULARTOLERANCE);
 
- for(int i = 0; i < map.size(); i++) {
+ for(int i : anchors) {
   vector<int> id;
 
-  if(map[i].validation < VALIDATIONFILTERKEEP)
+  if(map.erased[i] || lines[i].validation < VALIDATIONFILTERKEEP)
    continue;
 
   id.push_back(i);
-  for(int j = i + 1; j < map.size(); j++) {
-   if(map[j].validation < VALIDATIONFILTERKEEP)
+  queryHough(hough, lines[i].a, lines[i].b, -SMALLDISTTOLERANCE, candidates);
+  sortRanks(ranks, candidates);
+  for(int k = 0; k < candidates.size(); k++) {
+   int j = candidates[k];
+   if(ranks[j] <= ranks[i] || map.erased[j] || lines[j].validation < VALIDATIONFILTERKEEP || !work[i] && !work[j])
     continue;
 
    Point pointError;
    double angularError;
    int distError;
-   if(testLines(map[i], map[j], SMALLDISTTOLERANCE, SMALLANGULARTOLERANCE, -SMALLDISTTOLERANCE,
+   if(testLines(lines[i], lines[j], SMALLDISTTOLERANCE, SMALLANGULARTOLERANCE, -SMALLDISTTOLERANCE,
                 pointError, angularError, distError))
     id.push_back(j);
   }
@@ -509,61 +974,82 @@ void mapDeduplicateAverage(vector<Line> &map) {
   if(nbLines > 1) {
 
    for(int j = 0; j < nbLines; j++) {
+    bool grown = false;
     for(int k = 0; k < nbLines; k++) {
-     growLine(map[id[j]], map[id[k]].a);
-     growLine(map[id[j]], map[id[k]].b);
+     grown |= growLine(lines[id[j]], lines[id[k]].a);
+     grown |= growLine(lines[id[j]], lines[id[k]].b);
+    }
+    if(grown) {
+     touchLine(map, id[j]);
+     insertHough(hough, id[j], lines[id[j]].a, lines[id[j]].b);
     }
    }
 
-   Line averageLine = map[i];
+   Line averageLine = lines[i];
    int nbAverages = 1;
    for(int j = nbLines - 1; j > 0; j--) {
-    if(sqDist(map[i].a, map[j].a) < SMALLDISTTOLERANCE * SMALLDISTTOLERANCE &&
-       sqDist(map[i].b, map[j].b) < SMALLDISTTOLERANCE * SMALLDISTTOLERANCE) {
-     averageLine.a += map[id[j]].a;
-     averageLine.b += map[id[j]].b;
-     map.erase(map.begin() + id[j]);
+    if(sqDist(lines[i].a, lines[id[j]].a) < SMALLDISTTOLERANCE * SMALLDISTTOLERANCE && // Rang dans le groupe, pas emplacement
+       sqDist(lines[i].b, lines[id[j]].b) < SMALLDISTTOLERANCE * SMALLDISTTOLERANCE) {
+     averageLine.a += lines[id[j]].a;
+     averageLine.b += lines[id[j]].b;
+     eraseLine(map, id[j]);
      nbAverages++;
     }
    }
 
    averageLine.a /= nbAverages;
    averageLine.b /= nbAverages;
-   map[i] = averageLine;
-   sort = true;
+   bool moved = averageLine.a != lines[i].a || averageLine.b != lines[i].b;
+   lines[i] = averageLine;
+   if(moved) {
+    touchLine(map, i);
+    insertHough(hough, i, lines[i].a, lines[i].b);
+   }
   }
  }
-
- if(sort)
-  sortLines(map);
 }
 
-void mapDeduplicateErase(vector<Line> &map) {
- for(int i = 0; i < map.size(); i++) {
-  if(map[i].validation < VALIDATIONFILTERKEEP)
+void mapDeduplicateErase(LineMap &map) {
+ vector<Line> &lines = map.lines;
+ HoughIndex hough;
+ vector<bool> work;
+ vector<int> anchors;
+ vector<int> ranks;
+ vector<int> candidates;
+ map.maintaining = true;
+ dirtyLines(map, reverseMargin(map, LARGEDISTTOLERANCE, LARGEANGULARTOLERANCE), work, anchors);
+ rankLines(map, anchors, ranks);
+ buildHough(hough, map, anchors, LARGEDISTTOLERANCE, LARGEANGULARTOLERANCE);
+
+ for(int i : anchors) {
+  if(map.erased[i] || lines[i].validation < VALIDATIONFILTERKEEP)
    continue;
 
-  for(int j = i + 1; j < map.size(); j++) {
-   if(map[j].validation < VALIDATIONFILTERKEEP)
+  queryHough(hough, lines[i].a, lines[i].b, -SMALLDISTTOLERANCE, candidates);
+  sortRanks(ranks, candidates);
+  for(int k = 0; k < candidates.size(); k++) {
+   int j = candidates[k];
+   if(ranks[j] <= ranks[i] || map.erased[j] || lines[j].validation < VALIDATIONFILTERKEEP || !work[i] && !work[j])
     continue;
 
    Point pointError;
    double angularError;
    int distError;
-   if(testLines(map[i], map[j], LARGEDISTTOLERANCE, LARGEANGULARTOLERANCE, -SMALLDISTTOLERANCE,
-                pointError, angularError, distError)) {
-    map.erase(map.begin() + j);
-    j--;
-   }
+   if(testLines(lines[i], lines[j], LARGEDISTTOLERANCE, LARGEANGULARTOLERANCE, -SMALLDISTTOLERANCE,
+                pointError, angularError, distError))
+    eraseLine(map, j);
   }
  }
 }
 
-bool computeErrors(vector<Line> &mapLines, vector<Line> &map,
+bool computeErrors(vector<Line> &mapLines, const vector<Line> &map, const vector<int> &order, MapIndex *index,
                    Point &pointErrorOut, double &angularErrorOut, int &confidence,
                    int distTolerance, double angularTolerance) {
 
+ vector<int> candidates;
+
  int mapLinesWeightSum = 0;
+ int matchedWeightSum = 0;
  Point pointErrorSum = Point(0, 0);
  int pointErrorWeightSum = 0;
  double angularErrorSum = 0.0;
@@ -572,7 +1058,16 @@ bool computeErrors(vector<Line> &mapLines, vector<Line> &map,
  for(int i = 0; i < mapLines.size(); i++) {
   mapLinesWeightSum += int(sqrt(sqDist(mapLines[i])));
 
-  for(int j = 0; j < map.size(); j++) {
+  if(index)
+   queryLine(*index, mapLines[i], lineMargin(mapLines[i], distTolerance), candidates);
+  else {                                                     // Recherche exhaustive, référence du banc d'essai
+   candidates.resize(map.size());
+   for(int j = 0; j < map.size(); j++)
+    candidates[j] = j;
+  }
+
+  for(int k = 0; k < candidates.size(); k++) {
+   int j = order[candidates[k]];
    Point pointError;
    double angularError;
    int distError;
@@ -582,12 +1077,14 @@ bool computeErrors(vector<Line> &mapLines, vector<Line> &map,
       testLines(mapLines[i], map[j], distTolerance, angularTolerance, -SMALLDISTTOLERANCE,
                 pointError, angularError, distError, length)) {
 
-    pointErrorSum += pointError * length;
-    pointErrorWeightSum += length;
+    int weight = length * RESIDUALWEIGHT / (RESIDUALWEIGHT + mapLines[i].residual);
+    matchedWeightSum += length;
+    pointErrorSum += pointError * weight;
+    pointErrorWeightSum += weight;
 
     if(map[j].validation >= VALIDATIONFILTERKEEP) {
-     angularErrorSum += angularError * length;
-     angularErrorWeightSum += length;
+     angularErrorSum += angularError * weight;
+     angularErrorWeightSum += weight;
     }
 
     break;
@@ -596,7 +1093,7 @@ bool computeErrors(vector<Line> &mapLines, vector<Line> &map,
  }
 
  if(mapLinesWeightSum)
-  confidence = pointErrorWeightSum * 100 / mapLinesWeightSum;
+  confidence = matchedWeightSum * 100 / mapLinesWeightSum;
  else
   confidence = 100;
 
@@ -610,33 +1107,40 @@ bool computeErrors(vector<Line> &mapLines, vector<Line> &map,
   return false;
 }
 
-void mapping(vector<Line> &mapLines, vector<Line> &map) {
+void mapping(vector<Line> &mapLines, LineMap &map) {
+ vector<Line> &lines = map.lines;
  vector<Line> newLines;
- bool sort = false;
+ vector<int> candidates;
 
  for(int i = 0; i < mapLines.size(); i++) {
   if(sqDist(mapLines[i]) < MAPLINESMINLEN * MAPLINESMINLEN)
    continue;
 
   bool newLine = true;
-  for(int j = 0; j < map.size(); j++) {
+  queryLine(map.index, mapLines[i], lineMargin(mapLines[i], LARGEDISTTOLERANCE * 2), candidates);
+  for(int k = 0; k < candidates.size(); k++) {
+   int j = candidates[k];
+   if(map.erased[j])
+    continue;
+
    Point pointError;
    double angularError;
    int distError;
-   if(!testLines(mapLines[i], map[j], LARGEDISTTOLERANCE * 2, LARGEANGULARTOLERANCE, -SMALLDISTTOLERANCE,
+   if(!testLines(mapLines[i], lines[j], LARGEDISTTOLERANCE * 2, LARGEANGULARTOLERANCE, -SMALLDISTTOLERANCE,
       pointError, angularError, distError))
     continue;
 
    newLine = false;
 
-   if(map[j].validation < VALIDATIONFILTERKEEP && distError <= LARGEDISTTOLERANCE) {
-    map[j].intega += mapLines[i].a;
-    map[j].integb += mapLines[i].b;
-    map[j].integ++;
-    map[j].validation++;
+   if(lines[j].validation < VALIDATIONFILTERKEEP && distError <= LARGEDISTTOLERANCE) {
+    lines[j].intega += mapLines[i].a;
+    lines[j].integb += mapLines[i].b;
+    lines[j].integ++;
+    lines[j].validation++;
 
-    map[j].a = map[j].intega / map[j].integ;
-    map[j].b = map[j].integb / map[j].integ;
+    lines[j].a = lines[j].intega / lines[j].integ;
+    lines[j].b = lines[j].integb / lines[j].integ;
+    touchLine(map, j);                                       // La ligne a pu se déplacer
     break;
    }
 
@@ -644,10 +1148,10 @@ void mapping(vector<Line> &mapLines, vector<Line> &map) {
     break;
 
    bool grown = false;
-   grown |= growLine(map[j], mapLines[i].a);
-   grown |= growLine(map[j], mapLines[i].b);
+   grown |= growLine(lines[j], mapLines[i].a);
+   grown |= growLine(lines[j], mapLines[i].b);
    if(grown)
-    sort = true;
+    touchLine(map, j);
   }
 
   if(newLine)
@@ -661,15 +1165,12 @@ void mapping(vector<Line> &mapLines, vector<Line> &map) {
   newLines[i].validation = VALIDATIONFILTERSTART;
   newLines[i].shrinka = SHRINKFILTER;
   newLines[i].shrinkb = SHRINKFILTER;
-  map.push_back(newLines[i]);
-  sort = true;
+  addLine(map, newLines[i]);
  }
-
- if(sort)
-  sortLines(map);
 }
 
-void mapFiltersDecay(vector<Line> &map) {
+void mapFiltersDecay(LineMap &map) {                          // Une ligne au repos n'est jamais propre, elle est dans map.touched
+ vector<Line> &lines = map.lines;
  static int n = 0;
 
  if(n++ == MAPFILTERSDECAY)
@@ -677,18 +1178,31 @@ void mapFiltersDecay(vector<Line> &map) {
  else
   return;
 
- for(int i = 0; i < map.size(); i++) {
-  if(map[i].validation > VALIDATIONFILTERKILL && map[i].validation < VALIDATIONFILTERKEEP)
-   map[i].validation--;
-  else if(map[i].validation <= VALIDATIONFILTERKILL) {
-   map.erase(map.begin() + i);
-   i--;
+ map.maintaining = true;
+ for(int i : vector<int>(map.touched)) {
+  if(map.erased[i])
+   continue;
+
+  bool decayed = false;
+  if(lines[i].validation > VALIDATIONFILTERKILL && lines[i].validation < VALIDATIONFILTERKEEP) {
+   lines[i].validation--;
+   decayed = true;
+  } else if(lines[i].validation <= VALIDATIONFILTERKILL) {
+   eraseLine(map, i);
+   continue;
+  }
+
+  if(lines[i].shrinka < SHRINKFILTER) {
+   lines[i].shrinka++;
+   decayed = true;
+  }
+  if(lines[i].shrinkb < SHRINKFILTER) {
+   lines[i].shrinkb++;
+   decayed = true;
   }
 
-  if(map[i].shrinka < SHRINKFILTER)
-   map[i].shrinka++;
-  if(map[i].shrinkb < SHRINKFILTER)
-   map[i].shrinkb++;
+  if(decayed)
+   touchLine(map, i);
  }
 }
 
@@ -709,7 +1223,7 @@ void splitAxes(vector<Line> &robotLines, vector<Line> robotLinesAxes[]) {
  }
 }
 
-void localization(vector<Line> robotLinesAxes[], vector<Line> &map, int confidences[], Point &robotPoint, uint16_t &robotTheta) {
+void localization(vector<Line> robotLinesAxes[], const vector<Line> &map, const vector<int> &order, MapIndex &index, int confidences[], Point &robotPoint, uint16_t &robotTheta) {
  static int c[AXES] = {0};
 
  for(int i = 0; i < NBITERATIONS; i++) {
@@ -727,7 +1241,7 @@ void localization(vector<Line> robotLinesAxes[], vector<Line> &map, int confiden
    else
     distTolerance = LARGEDISTTOLERANCE;
 
-   if(computeErrors(mapLinesAxe, map, pointError, angularError, confidence,
+   if(computeErrors(mapLinesAxe, map, order, &index, pointError, angularError, confidence,
       distTolerance / (i + 1), LARGEANGULARTOLERANCE / (i + 1))) {
 
     robotPoint -= pointError / (i + 1);
@@ -747,6 +1261,171 @@ void localization(vector<Line> robotLinesAxes[], vector<Line> &map, int confiden
   c[i] = confidences[i];
 }
 
+void updateMapField(DistanceField &field, vector<array<int, 4>> &fieldLines, const vector<Line> &map) { // Seules les tuiles des lignes modifiées sont recalculées
+ vector<array<int, 4>> lines;
+ for(int i = 0; i < map.size(); i++) {
+  if(map[i].validation >= VALIDATIONFILTERSTART)
+   lines.push_back({map[i].a.x, map[i].a.y, map[i].b.x, map[i].b.y});
+ }
+ sort(lines.begin(), lines.end());
+
+ vector<array<int, 4>> removed;
+ vector<array<int, 4>> added;
+ set_difference(fieldLines.begin(), fieldLines.end(), lines.begin(), lines.end(), back_inserter(removed));
+ set_difference(lines.begin(), lines.end(), fieldLines.begin(), fieldLines.end(), back_inserter(added));
+
+ for(int i = 0; i < removed.size(); i++)
+  removeField(field, Point(removed[i][0], removed[i][1]), Point(removed[i][2], removed[i][3]));
+ for(int i = 0; i < added.size(); i++)
+  insertField(field, Point(added[i][0], added[i][1]), Point(added[i][2], added[i][3]));
+
+ updateField(field);
+ fieldLines.swap(lines);
+}
+
+bool relocalization(vector<Point> &robotPoints, const vector<Line> &map, DistanceField &field, vector<array<int, 4>> &fieldLines,
+                    RelocGrid &grid, bool rebuild, Point &robotPoint, uint16_t &robotTheta) {
+ uint64_t start = getTimeNs(CLOCK_MONOTONIC);
+
+ if(rebuild) {
+  updateMapField(field, fieldLines, map);                    // Rien à recalculer si la localisation utilise déjà ce champ
+
+  Point low = Point(INT_MAX, INT_MAX);
+  Point high = Point(INT_MIN, INT_MIN);
+  for(int i = 0; i < fieldLines.size(); i++) {
+   low = Point(min(low.x, min(fieldLines[i][0], fieldLines[i][2])), min(low.y, min(fieldLines[i][1], fieldLines[i][3])));
+   high = Point(max(high.x, max(fieldLines[i][0], fieldLines[i][2])), max(high.y, max(fieldLines[i][1], fieldLines[i][3])));
+  }
+
+  if(fieldLines.empty())
+   grid.width = 0;
+  else
+   buildRelocGrid(grid, field, low, high);
+ }
+
+ Point point;
+ double theta;
+ int score;
+ if(!grid.width || !relocalize(grid, robotPoints, RELOCSCOREMIN, RELOCBUDGET, point, theta, score)) {
+  fprintf(stderr, "Relocalization failed in %d ms\n", int((getTimeNs(CLOCK_MONOTONIC) - start) / 1000000));
+  return false;
+ }
+
+ uint16_t thetaError = angleDoubleToAngle16(theta) - robotTheta;
+ fprintf(stderr, "Relocalization from %d %d %d to %d %d %d with a score of %d %% in %d ms\n",
+         robotPoint.x, robotPoint.y, robotTheta, point.x, point.y, uint16_t(robotTheta + thetaError), score,
+         int((getTimeNs(CLOCK_MONOTONIC) - start) / 1000000));
+
+ robotPoint = point;
+ robotTheta += thetaError;
+#ifdef IMU
+ robotThetaCorrector += thetaError;
+#endif
+
+ return true;
+}
+
+double det3(double m[3][3]) {
+ return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+        m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+        m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+}
+
+bool solveNormal(double h[3][3], double b[3], double x[3]) { // Règle de Cramer
+ double det = det3(h);
+ if(abs(det) < 1e-9)
+  return false;
+
+ for(int k = 0; k < 3; k++) {
+  double m[3][3];
+  for(int i = 0; i < 3; i++) {
+   for(int j = 0; j < 3; j++)
+    m[i][j] = j == k ? b[i] : h[i][j];
+  }
+  x[k] = det3(m) / det;
+ }
+
+ return true;
+}
+
+void localizationField(vector<Point> &robotPoints, const DistanceField &field, int confidences[], Point &robotPoint, uint16_t &robotTheta) {
+ double x = robotPoint.x;
+ double y = robotPoint.y;
+ double theta = angle16ToAngleDouble(robotTheta);
+ int matched = 0;
+ int inliers = 0;
+ int nbPoints = 0;
+
+ for(int i = 0; i < NBITERATIONS; i++) {
+  double h[3][3] = {{0.0}};
+  double b[3] = {0.0};
+  double sinTheta = sin(theta);
+  double cosTheta = cos(theta);
+  matched = 0;
+  inliers = 0;
+  nbPoints = 0;
+
+  for(int j = 0; j < robotPoints.size(); j++) {
+   Point point = robotPoints[j];
+   if(point == Point(0, 0))                                  // Pas d'écho
+    continue;
+   nbPoints++;
+
+   double rotatedX = point.x * cosTheta - point.y * sinTheta;
+   double rotatedY = point.x * sinTheta + point.y * cosTheta;
+   double dist;
+   double gradX;
+   double gradY;
+
+   if(!sampleField(field, x + rotatedX, y + rotatedY, dist, gradX, gradY) || dist >= FIELDMAXDIST)
+    continue;
+
+   matched++;
+   if(dist <= SMALLDISTTOLERANCE)
+    inliers++;
+
+   double weight = dist <= FIELDHUBER ? 1.0 : FIELDHUBER / dist;
+   double jacobian[3] = {gradX, gradY, gradY * rotatedX - gradX * rotatedY};
+
+   for(int k = 0; k < 3; k++) {
+    for(int l = 0; l < 3; l++)
+     h[k][l] += weight * jacobian[k] * jacobian[l];
+    b[k] -= weight * jacobian[k] * dist;
+   }
+  }
+
+  h[0][0] += FIELDDAMPING;                                   // Retient la pose le long d'un couloir
+  h[1][1] += FIELDDAMPING;
+  h[2][2] += FIELDDAMPING * 1000.0 * 1000.0;
+
+  double step[3];
+  if(matched < FIELDMATCHEDMIN || !solveNormal(h, b, step))
+   break;
+
+  x += step[0];
+  y += step[1];
+  theta += step[2];
+
+  if(abs(step[0]) < FIELDSTEPMIN && abs(step[1]) < FIELDSTEPMIN && abs(step[2]) < FIELDANGULARSTEPMIN)
+   break;
+ }
+
+ int confidence = nbPoints ? inliers * 100 / nbPoints : 0;
+ for(int i = 0; i < AXES; i++)
+  confidences[i] = confidence;
+
+ if(matched < FIELDMATCHEDMIN)
+  return;
+
+ robotPoint = Point(lround(x), lround(y));
+ uint16_t thetaError = angleDoubleToAngle16(theta) - robotTheta;
+#ifdef IMU
+ robotThetaCorrector += int16_t(thetaError) / IMUTHETACORRECTORDIV;
+#else
+ robotTheta += thetaError;
+#endif
+}
+
 Point rescaleTranslate(Point point, int mapDiv) {
  point.x = point.x * 10 / mapDiv;
  point.y = point.y * 10 / -mapDiv;
@@ -758,10 +1437,10 @@ void drawLidarPoints(Mat &image, vector<Point> &points, bool beams, Point beamsS
   Point point = rescaleTranslate(points[i] - offset, mapDiv);
 
   if(beams)
-   line(image, beamsSource, point, Scalar::all(64), 1, LINE_AA);
+   drawLine(image, beamsSource, point, Scalar::all(64), 1, LINE_AA, yuv);
   else if(point.x >= 0 && point.x < width &&
           point.y >= 0 && point.y < height)
-   image.at<Vec3b>(point.y, point.x) = Vec3b(255, 255, 255);
+   drawPixel(image, point, Scalar::all(255), yuv);
  }
 }
 
@@ -772,9 +1451,9 @@ void drawLidarLines(Mat &image, vector<Line> robotLinesAxes[], int mapDiv) {
    Point point2 = rescaleTranslate(robotLinesAxes[i][j].b, mapDiv);
 
    if(i == 0)
-    line(image, point1, point2, Scalar(128, 128, 255), 1, LINE_AA);
+    drawLine(image, point1, point2, Scalar(128, 128, 255), 1, LINE_AA, yuv);
    else
-    line(image, point1, point2, Scalar(255, 128, 128), 1, LINE_AA);
+    drawLine(image, point1, point2, Scalar(255, 128, 128), 1, LINE_AA, yuv);
   }
  }
 }
@@ -784,7 +1463,7 @@ void drawLidarLines(Mat &image, vector<Line> &lines, Point offset, int mapDiv) {
   Point point1 = rescaleTranslate(lines[i].a - offset, mapDiv);
   Point point2 = rescaleTranslate(lines[i].b - offset, mapDiv);
 
-  line(image, point1, point2, Scalar::all(255), 1, LINE_AA);
+  drawLine(image, point1, point2, Scalar::all(255), 1, LINE_AA, yuv);
  }
 }
 
@@ -795,7 +1474,7 @@ void drawMap(Mat &image, vector<Line> &map, bool light, Point robotPoint, uint16
 
   if(light) {
    if(map[i].validation >= VALIDATIONFILTERKEEP)
-    line(image, point1, point2, Scalar::all(128), 1, LINE_AA);
+    drawLine(image, point1, point2, Scalar::all(128), 1, LINE_AA, yuv);
   } else {
    Scalar color;
    if(map[i].validation < VALIDATIONFILTERKEEP)
@@ -806,7 +1485,7 @@ void drawMap(Mat &image, vector<Line> &map, bool light, Point robotPoint, uint16
     uchar hue = uchar(angleDeg / 2.0 + 90.0) % 180;
     color = hueToBgr[hue];
    }
-   line(image, point1, point2, color, 2, LINE_AA);
+   drawLine(image, point1, point2, color, 2, LINE_AA, yuv);
   }
 
  }
@@ -827,7 +1506,7 @@ void drawHist(Mat &image, Point histPoint, Point robotPoint, uint16_t robotTheta
   if(i != 0) {
    int distTolerancePixels = LARGEDISTTOLERANCE * 10 / mapDiv;
    if(sqDist(oldPoint, point) < distTolerancePixels * distTolerancePixels)
-    line(image, oldPoint, point, Scalar(0, 128, 128), 1, LINE_AA);
+    drawLine(image, oldPoint, point, Scalar(0, 128, 128), 1, LINE_AA, yuv);
   }
 
   oldPoint = point;
@@ -836,7 +1515,7 @@ void drawHist(Mat &image, Point histPoint, Point robotPoint, uint16_t robotTheta
 
 void drawColoredPoint(Mat &image, Point point, Scalar color, Point robotPoint, uint16_t robotTheta, int mapDiv) {
  point = rescaleTranslate(rotate(point - robotPoint, -robotTheta), mapDiv);
- circle(image, point, 2, color, FILLED, LINE_AA);
+ drawCircle(image, point, 2, color, FILLED, LINE_AA, yuv);
 }
 
 void drawPath(Mat &image, vector<Point> &nodes, vector<int> &paths, int end, Point robotPoint, uint16_t robotTheta, int mapDiv) {
@@ -846,7 +1525,7 @@ void drawPath(Mat &image, vector<Point> &nodes, vector<int> &paths, int end, Poi
  while(n != -1) {
   Point point = rescaleTranslate(rotate(nodes[n] - robotPoint, -robotTheta), mapDiv);
 
-  line(image, oldPoint, point, Scalar(128, 128, 0), 1, LINE_AA);
+  drawLine(image, oldPoint, point, Scalar(128, 128, 0), 1, LINE_AA, yuv);
   oldPoint = point;
 
   n = paths[n];
@@ -856,8 +1535,8 @@ void drawPath(Mat &image, vector<Point> &nodes, vector<int> &paths, int end, Poi
 void drawTargetPoint(Mat &image, Point targetPoint, Point robotPoint, uint16_t robotTheta, int mapDiv) {
  Point point = rescaleTranslate(rotate(targetPoint - robotPoint, -robotTheta), mapDiv);
 
- line(image, point + Point(-5, -5), point + Point(5, 5), Scalar(0, 255, 255), 1, LINE_AA);
- line(image, point + Point(-5, 5), point + Point(5, -5), Scalar(0, 255, 255), 1, LINE_AA);
+ drawLine(image, point + Point(-5, -5), point + Point(5, 5), Scalar(0, 255, 255), 1, LINE_AA, yuv);
+ drawLine(image, point + Point(-5, 5), point + Point(5, -5), Scalar(0, 255, 255), 1, LINE_AA, yuv);
 }
 
 void drawRobot(Mat &image, vector<Point> robotIcon, int thickness, Point robotPoint, uint16_t robotTheta, int mapDiv) {
@@ -869,13 +1548,13 @@ void drawRobot(Mat &image, vector<Point> robotIcon, int thickness, Point robotPo
  }
 
  vector<vector<Point>> tmp(1, polygon);
- drawContours(image, tmp, -1, Scalar::all(255), thickness, LINE_AA);
+ drawPolygons(image, tmp, Scalar::all(255), thickness, LINE_AA, yuv);
 }
 
 void drawNodes(Mat &image, vector<Point> &nodes, Point robotPoint, uint16_t robotTheta, int mapDiv) {
  for(int i = 0; i < nodes.size(); i++) {
   Point point = rescaleTranslate(rotate(nodes[i] - robotPoint, -robotTheta), mapDiv);
-  circle(image, point, 1, Scalar::all(128), FILLED, LINE_AA);
+  drawCircle(image, point, 1, Scalar::all(128), FILLED, LINE_AA, yuv);
  }
 }
 
@@ -890,12 +1569,12 @@ void drawWayPoints(Mat &image, vector<Point> &wayPoints, Point targetPoint, Poin
   Size textSize = getTextSize(text, FONT_HERSHEY_PLAIN, 1.0, 1, &baseline);
   Point textPoint = Point(-textSize.width / 2, textSize.height / 2) + point;
 
-  putText(image, text, textPoint, FONT_HERSHEY_PLAIN, 1.0, Scalar::all(0), 1);
-  putText(image, text, textPoint + Point(1, 1), FONT_HERSHEY_PLAIN, 1.0, Scalar::all(255), 1);
+  drawText(image, text, textPoint, FONT_HERSHEY_PLAIN, 1.0, Scalar::all(0), 1, yuv);
+  drawText(image, text, textPoint + Point(1, 1), FONT_HERSHEY_PLAIN, 1.0, Scalar::all(255), 1, yuv);
 
   if(wayPoints[i] == targetPoint) {
-   circle(image, point, textSize.width / 2 + 3, Scalar::all(0), 1, LINE_AA);
-   circle(image, point + Point(1, 1), textSize.width / 2 + 3, Scalar::all(255), 1, LINE_AA);
+   drawCircle(image, point, textSize.width / 2 + 3, Scalar::all(0), 1, LINE_AA, yuv);
+   drawCircle(image, point + Point(1, 1), textSize.width / 2 + 3, Scalar::all(255), 1, LINE_AA, yuv);
   }
  }
 }
@@ -905,7 +1584,7 @@ void drawWayPoints(Mat &image, vector<Point> &wayPoints, Point targetPoint, Poin
   Point point1 = rescaleTranslate(rotate(nodes[links[i][0]] - robotPoint, -robotTheta), mapDiv);
   Point point2 = rescaleTranslate(rotate(nodes[links[i][1]] - robotPoint, -robotTheta), mapDiv);
 
-  line(image, point1, point2, Scalar::all(128), 1, LINE_AA);
+  drawLine(image, point1, point2, Scalar::all(128), 1, LINE_AA, yuv);
  }
 }
 
@@ -924,7 +1603,7 @@ void drawIntersects(Mat &image, vector<Line> &map, Point robotPoint, uint16_t ro
 
    Point point = rescaleTranslate(rotate(intersectPoint - robotPoint, -robotTheta), mapDiv);
 
-   circle(image, point, 2, Scalar::all(255), FILLED, LINE_AA);
+   drawCircle(image, point, 2, Scalar::all(255), FILLED, LINE_AA, yuv);
   }
  }
 }*/
@@ -949,56 +1628,9 @@ bool obstacle(vector<Point> &mapPoints, Point robotPoint, Point targetPoint, int
  return false;
 }
 
-void dijkstra(list<pair<int, int>> adjacent[], int nbNodes, int start, vector<int> &pathsOut, vector<int> &distsOut) {
- priority_queue<Pair, vector<Pair>, greater<Pair>> pq;
- vector<int> dists(nbNodes, INT_MAX);
- vector<bool> flags(nbNodes, false);
- vector<int> paths(nbNodes, -1);
-
- pq.push(make_pair(0, start));
- dists[start] = 0;
-
- while(!pq.empty()) {
-  int a = pq.top().second;
-  pq.pop();
-  flags[a] = true;
-
-  list<pair<int, int>>::iterator i;
-  for(i = adjacent[a].begin(); i != adjacent[a].end(); ++i) {
-   int b = (*i).first;
-   int weight = (*i).second;
-
-   if(flags[b] == false && dists[b] > dists[a] + weight) {
-    dists[b] = dists[a] + weight;
-    paths[b] = a;
-    pq.push(make_pair(dists[b], b));
-   }
-  }
- }
-
- pathsOut = paths;
- distsOut = dists;
-}
-
-void addLink(list<pair<int, int>> adjacent[], int a, int b, int weight) {
- adjacent[a].push_back(make_pair(b, weight));
- adjacent[b].push_back(make_pair(a, weight));
-}
-
-void computePaths(vector<Point> &nodes, vector<array<int, 2>> &links, int start, vector<int> &paths, vector<int> &dists) {
- fprintf(stderr, "Launching Dijkstra's algorithm with %d nodes and %d links for the node %d\n", nodes.size(), links.size(), start);
-
- list<pair<int, int>> *adjacent;
- adjacent = new list<Pair>[nodes.size()];
-
- for(int i = 0; i < links.size(); i++) {
-  int dist = int(sqrt(sqDist(nodes[links[i][0]], nodes[links[i][1]])));
-  addLink(adjacent, links[i][0], links[i][1], dist);
- }
-
- dijkstra(adjacent, nodes.size(), start, paths, dists);
-
- delete [] adjacent;
+void computePaths(Graph &graph, int start, vector<int> &paths, vector<int> &dists) {
+ fprintf(stderr, "Launching Dijkstra's algorithm with %d nodes and %d links for the node %d\n", graph.nodes.size(), graph.nbLinks, start);
+ dijkstra(graph, start, paths, dists);
  fprintf(stderr, "Ending Dijkstra's algorithm\n");
 }
 
@@ -1017,9 +1649,10 @@ int closestPoint(vector<Point> &points, Point point) {
  return closest;
 }
 
-bool addNodeAndLinks(vector<Point> &mapPoints, vector<Point> &nodes, vector<array<int, 2>> &links, Point node) {
+bool addNodeAndLinks(vector<Point> &mapPoints, Graph &graph, Point node) {
+ vector<Point> &nodes = graph.nodes;
  if(nodes.empty()) {
-  nodes.push_back(node);
+  addGraphNode(graph, node);
   return true;
  }
 
@@ -1027,15 +1660,15 @@ bool addNodeAndLinks(vector<Point> &mapPoints, vector<Point> &nodes, vector<arra
  if(sqDist(node, nodes[closest]) < LINKSLENGTHMIN * LINKSLENGTHMIN)
   return false;
 
- vector<array<int, 2>> linksBuffer;
+ vector<int> neighbors;
  for(int i = 0; i < nodes.size(); i++) {
   int dist = sqDist(node, nodes[i]);
 
   if(dist <= LINKSLENGTHMAX * LINKSLENGTHMAX)
-   linksBuffer.push_back({int(nodes.size()), i});
+   neighbors.push_back(i);
  }
 
- if(!linksBuffer.empty()) {
+ if(!neighbors.empty()) {
   bool ok = true;
 
   for(int i = 1; i < mapPoints.size(); i++)
@@ -1043,10 +1676,10 @@ bool addNodeAndLinks(vector<Point> &mapPoints, vector<Point> &nodes, vector<arra
     ok = false;
 
   if(ok) {
-   fprintf(stderr, "Adding the node %d with %d link(s)\n", nodes.size(), linksBuffer.size());
-   nodes.push_back(node);
-   for(int i = 0; i < linksBuffer.size(); i++)
-    links.push_back(linksBuffer[i]);
+   fprintf(stderr, "Adding the node %d with %d link(s)\n", nodes.size(), neighbors.size());
+   int n = addGraphNode(graph, node);
+   for(int i = 0; i < neighbors.size(); i++)
+    addGraphLink(graph, n, neighbors[i]);
 
    return true;
   }
@@ -1055,9 +1688,10 @@ bool addNodeAndLinks(vector<Point> &mapPoints, vector<Point> &nodes, vector<arra
  return false;
 }
 
-bool addNodeAndLinks(vector<Point> &nodes, vector<array<int, 2>> &links, Point node) {
+bool addNodeAndLinks(Graph &graph, Point node) {
+ vector<Point> &nodes = graph.nodes;
  if(nodes.empty()) {
-  nodes.push_back(node);
+  addGraphNode(graph, node);
   return true;
  }
 
@@ -1065,19 +1699,19 @@ bool addNodeAndLinks(vector<Point> &nodes, vector<array<int, 2>> &links, Point n
  if(sqDist(node, nodes[closest]) < LINKSLENGTHMIN * LINKSLENGTHMIN)
   return false;
 
- vector<array<int, 2>> linksBuffer;
+ vector<int> neighbors;
  for(int i = 0; i < nodes.size(); i++) {
   int dist = sqDist(node, nodes[i]);
 
   if(dist <= LINKSLENGTHMAX * LINKSLENGTHMAX)
-   linksBuffer.push_back({int(nodes.size()), i});
+   neighbors.push_back(i);
  }
 
- if(!linksBuffer.empty()) {
-  fprintf(stderr, "Adding the node %d with %d link(s)\n", nodes.size(), linksBuffer.size());
-  nodes.push_back(node);
-  for(int i = 0; i < linksBuffer.size(); i++)
-   links.push_back(linksBuffer[i]);
+ if(!neighbors.empty()) {
+  fprintf(stderr, "Adding the node %d with %d link(s)\n", nodes.size(), neighbors.size());
+  int n = addGraphNode(graph, node);
+  for(int i = 0; i < neighbors.size(); i++)
+   addGraphLink(graph, n, neighbors[i]);
 
   return true;
  }
@@ -1085,65 +1719,71 @@ bool addNodeAndLinks(vector<Point> &nodes, vector<array<int, 2>> &links, Point n
  return false;
 }
 
-void delNodeAndLinks(vector<Point> &nodes, vector<array<int, 2>> &links, int nodeIndex) {
- fprintf(stderr, "Deleting the node %d\n", nodeIndex);
+void delNodeAndLinks(Graph &graph, int nodeIndex, Point targetPoint, int &targetNode, vector<int> &paths, vector<int> &dists) {
+ fprintf(stderr, "Deleting the node %d with %d link(s)\n", nodeIndex, graph.rowSize[nodeIndex]);
 
- nodes.erase(nodes.begin() + nodeIndex);
- for(int i = 0; i < links.size(); i++) {
-  if(nodeIndex == links[i][0] ||
-     nodeIndex == links[i][1]) {
-   fprintf(stderr, "Deleting the associated link %d\n", i);
-   links.erase(links.begin() + i);
-   i--;
-  } else {
-   if(nodeIndex < links[i][0])
-    links[i][0]--;
-   if(nodeIndex < links[i][1])
-    links[i][1]--;
-  }
- }
+ int root = targetNode == graph.nodes.size() - 1 ? nodeIndex : targetNode; // Le dernier nœud prend le numéro du nœud supprimé
+ bool repair = nodeIndex != targetNode && paths.size() == graph.nodes.size();
+ if(repair) {                                                // Seul le sous-arbre des chemins qui passaient par le nœud est recalculé
+  fprintf(stderr, "Repairing the paths to the node %d\n", root);
+  delNodePaths(graph, nodeIndex, paths, dists);
+ } else
+  delGraphNode(graph, nodeIndex);
+
+ if(graph.nodes.empty())
+  return;
+
+ targetNode = closestPoint(graph.nodes, targetPoint);
+ if(!repair || targetNode != root)
+  computePaths(graph, targetNode, paths, dists);
 }
 
-void delNode(vector<Point> &nodes, vector<array<int, 2>> &links, int nodeIndex) {
- fprintf(stderr, "Deleting the node %d\n", nodeIndex);
+void applyGraphEdit(Graph &graph, vector<int> &paths, vector<int> &dists, int &targetNode, const GraphEdit &edit) {
+ switch(edit.type) {
+  case GRAPHEDITTARGET:
+   if(!graph.nodes.empty()) {
+    targetNode = closestPoint(graph.nodes, edit.targetPoint);
+    computePaths(graph, targetNode, paths, dists);
+   }
+   break;
 
- nodes.erase(nodes.begin() + nodeIndex);
- for(int i = 0; i < links.size(); i++) {
-  if(nodeIndex < links[i][0])
-   links[i][0]--;
-  if(nodeIndex < links[i][1])
-   links[i][1]--;
+  case GRAPHEDITADD:
+   if(addNodeAndLinks(graph, edit.node)) {
+    targetNode = closestPoint(graph.nodes, edit.targetPoint);
+    computePaths(graph, targetNode, paths, dists);
+   }
+   break;
+
+  case GRAPHEDITDELETE:
+   if(!graph.nodes.empty()) {
+    int node = closestPoint(graph.nodes, edit.node);
+    if(graph.nodes[node] == edit.node)                       // Sinon déjà supprimé par un étage
+     delNodeAndLinks(graph, node, edit.targetPoint, targetNode, paths, dists);
+   }
+   break;
+
+  case GRAPHEDITCLEAR:
+   clearGraph(graph);
+   paths.clear();
+   paths.push_back(-1);
+   break;
  }
 }
 
-void delLinkAndNodes(vector<Point> &nodes, vector<array<int, 2>> &links, int a, int b) {
- bool del = false;
+void delLinkAndNodes(Graph &graph, int a, int b) {
  int minab = min(a, b);
  int maxab = max(a, b);
- bool delmin = true;
- bool delmax = true;
 
- for(int i = 0; i < links.size(); i++) {
-  if(!del && (links[i][0] == a && links[i][1] == b || links[i][0] == b && links[i][1] == a)) {
-   fprintf(stderr, "Deleting the link %d\n", i);
-   links.erase(links.begin() + i);
-   i--;
-   del = true;
-  } else {
-   if(links[i][0] == minab || links[i][1] == minab)
-    delmin = false;
-   if(links[i][0] == maxab || links[i][1] == maxab)
-    delmax = false;
-  }
- }
+ if(delGraphLink(graph, a, b))
+  fprintf(stderr, "Deleting the link between %d and %d\n", a, b);
 
- if(delmax) {
+ if(graph.rowSize[maxab] == 0) {                             // Supprimé en premier, minab garde son numéro
   fprintf(stderr, "Deleting the node without link %d\n", maxab);
-  delNode(nodes, links, maxab);
+  delGraphNode(graph, maxab);
  }
- if(delmin) {
+ if(graph.rowSize[minab] == 0) {
   fprintf(stderr, "Deleting the node without link %d\n", minab);
-  delNode(nodes, links, minab);
+  delGraphNode(graph, minab);
  }
 }
 
@@ -1158,16 +1798,9 @@ void delLinkAndNodes(vector<Point> &nodes, vector<array<int, 2>> &links, int a,
  }
 }*/
 
-void graphing(vector<PolarPoint> &polarPoints, vector<Point> &mapPoints, vector<Point> &nodes, vector<array<int, 2>> &links,
+void graphing(vector<PolarPoint> &polarPoints, vector<Point> &mapPoints, Graph &graph,
               vector<int> &paths, vector<int> &dists, Point targetPoint, int &targetNode, Point robotPoint, uint16_t robotTheta) {
-
- static int n = 0;
-
- if(n++ == GRAPHINGSLOWDOWN)
-  n = 0;
- else
-  return;
-
+ int first = graph.nodes.size();
  bool added = false;
  for(int i = 0; i < polarPoints.size(); i++) {
   for(int j = polarPoints[i].distance - LINKSLENGTHMIN; j > LINKSLENGTHMIN; j -= LINKSLENGTHMIN / 2) {
@@ -1175,21 +1808,27 @@ void graphing(vector<PolarPoint> &polarPoints, vector<Point> &mapPoints, vector<
                              j * cos16(polarPoints[i].theta) / ONE16);
 
    Point closerMapPoint = robotPoint + rotate(closerPoint, robotTheta);
-   added |= addNodeAndLinks(mapPoints, nodes, links, closerMapPoint);
+   added |= addNodeAndLinks(mapPoints, graph, closerMapPoint);
   }
  }
 
  if(added) {
-  targetNode = closestPoint(nodes, targetPoint);
-  computePaths(nodes, links, targetNode, paths, dists);
+  int oldTargetNode = targetNode;
+  targetNode = closestPoint(graph.nodes, targetPoint);
+  if(first && targetNode == oldTargetNode && paths.size() == first) { // Même racine, seuls les raccourcis des nouveaux nœuds sont propagés
+   fprintf(stderr, "Repairing the paths for %d new node(s)\n", graph.nodes.size() - first);
+   addNodesPaths(graph, first, paths, dists);
+  } else
+   computePaths(graph, targetNode, paths, dists);
  }
 }
 
 void ui(Mat &image, vector<Point> &robotPoints, vector<Line> robotLinesAxes[], vector<Line> &mapLines, vector<Line> &map, vector<Point> &mapPoints,
-                    vector<Point> &nodes, vector<array<int, 2>> &links, vector<int> &paths, vector<int> &dists, vector<Point> &wayPoints, Point &targetPoint,
+                    Graph &graph, vector<int> &paths, vector<int> &dists, vector<GraphEdit> &graphEdits, vector<Point> &wayPoints, Point &targetPoint,
                     int &targetNode, int &closestRobot, Point &robotPoint, Point &oldRobotPoint, uint16_t &robotTheta, uint16_t &oldRobotTheta,
                     bool &mappingEnabled, bool &graphingEnabled, bool &running, bool &patrolling, int &select, int &mapDiv, int confidences[], int time) {
 
+ vector<Point> &nodes = graph.nodes;
  static int oldMapSize = 0;
  int xmin = INT_MAX;
  int xmax = INT_MIN;
@@ -1265,7 +1904,7 @@ void ui(Mat &image, vector<Point> &robotPoints, vector<Line> robotLinesAxes[], v
    targetNode = closestPoint(nodes, targetPoint);
    if(targetNode != oldTargetNode) {
     oldTargetNode = targetNode;
-    computePaths(nodes, links, targetNode, paths, dists);
+    computePaths(graph, targetNode, paths, dists);
    }
   }
  }
@@ -1296,12 +1935,9 @@ void ui(Mat &image, vector<Point> &robotPoints, vector<Line> robotLinesAxes[], v
     case SELECTFIXEDMAPPING:
     case SELECTMAPPING:
      mappingEnabled = !mappingEnabled;
-     for(int i = 0; i < map.size(); i++) {
-      if(map[i].validation < VALIDATIONFILTERKEEP) {
-       map.erase(map.begin() + i);
-       i--;
-      }
-     }
+     map.erase(remove_if(map.begin(), map.end(), [](const Line &line) {
+      return line.validation < VALIDATIONFILTERKEEP;
+     }), map.end());
      break;
    }
 
@@ -1320,10 +1956,8 @@ void ui(Mat &image, vector<Point> &robotPoints, vector<Line> robotLinesAxes[], v
     case SELECTGRAPHING:
      running = false;
      patrolling = false;
-     nodes.clear();
-     links.clear();
-     paths.clear();
-     paths.push_back(-1);
+     graphEdits.push_back({GRAPHEDITCLEAR});
+     applyGraphEdit(graph, paths, dists, targetNode, graphEdits.back());
      break;
 
     case SELECTFIXEDMAPPING:
@@ -1335,7 +1969,8 @@ void ui(Mat &image, vector<Point> &robotPoints, vector<Line> robotLinesAxes[], v
       robotTheta = 0;
       oldRobotTheta = 0;
 #ifdef IMU
-      imu->resetFusion();
+      if(imu)
+       imu->resetFusion();
       robotThetaCorrector = 0;
 #endif
      }
@@ -1374,11 +2009,10 @@ void ui(Mat &image, vector<Point> &robotPoints, vector<Line> robotLinesAxes[], v
 
     case SELECTFIXEDGRAPHING:
     case SELECTGRAPHING:
-     if(addNodeAndLinks(nodes, links, targetPoint)) {
-      targetNode = closestPoint(nodes, targetPoint);
-      computePaths(nodes, links, targetNode, paths, dists);
+     graphEdits.push_back({GRAPHEDITADD, targetPoint, targetPoint});
+     applyGraphEdit(graph, paths, dists, targetNode, graphEdits.back());
+     if(!nodes.empty())
       closestRobot = closestPoint(nodes, robotPoint);
-     }
      break;
    }
 
@@ -1396,13 +2030,12 @@ void ui(Mat &image, vector<Point> &robotPoints, vector<Line> robotLinesAxes[], v
 
     case SELECTFIXEDGRAPHING:
     case SELECTGRAPHING:
-     if(!nodes.empty())
-      delNodeAndLinks(nodes, links, targetNode);
      if(!nodes.empty()) {
-      targetNode = closestPoint(nodes, targetPoint);
-      computePaths(nodes, links, targetNode, paths, dists);
-      closestRobot = closestPoint(nodes, robotPoint);
+      graphEdits.push_back({GRAPHEDITDELETE, nodes[targetNode], targetPoint});
+      delNodeAndLinks(graph, targetNode, targetPoint, targetNode, paths, dists);
      }
+     if(!nodes.empty())
+      closestRobot = closestPoint(nodes, robotPoint);
      break;
 
     case SELECTFIXEDMAPPING:
@@ -1529,7 +2162,7 @@ void ui(Mat &image, vector<Point> &robotPoints, vector<Line> robotLinesAxes[], v
              robotPoint.x, targetPoint.x, robotPoint.y, targetPoint.y, thetaDeg, OFFON[graphingEnabled]);
     else
      sprintf(text, "Nodes %04d | Links %05d | X %06d | Y %06d | Theta %03d | Graph %s",
-             nodes.size(), links.size(), robotPoint.x, robotPoint.y, thetaDeg, OFFON[graphingEnabled]);
+             nodes.size(), graph.nbLinks, robotPoint.x, robotPoint.y, thetaDeg, OFFON[graphingEnabled]);
    }
    break;
 
@@ -1625,7 +2258,7 @@ void ui(Mat &image, vector<Point> &robotPoints, vector<Line> robotLinesAxes[], v
              robotPoint.x, targetPoint.x, robotPoint.y, targetPoint.y, thetaDeg, OFFON[graphingEnabled]);
     else
      sprintf(text, "Nodes %04d | Links %05d | X %06d | Y %06d | Theta %03d | Graph %s",
-             nodes.size(), links.size(), robotPoint.x, robotPoint.y, thetaDeg, OFFON[graphingEnabled]);
+             nodes.size(), graph.nbLinks, robotPoint.x, robotPoint.y, thetaDeg, OFFON[graphingEnabled]);
    }
    break;
 
@@ -1654,8 +2287,8 @@ void ui(Mat &image, vector<Point> &robotPoints, vector<Line> robotLinesAxes[], v
    break;
  }
 
- putText(image, text, Point(5, 15), FONT_HERSHEY_PLAIN, 1.0, Scalar::all(0), 1);
- putText(image, text, Point(6, 16), FONT_HERSHEY_PLAIN, 1.0, Scalar::all(255), 1);
+ drawText(image, text, Point(5, 15), FONT_HERSHEY_PLAIN, 1.0, Scalar::all(0), 1, yuv);
+ drawText(image, text, Point(6, 16), FONT_HERSHEY_PLAIN, 1.0, Scalar::all(255), 1, yuv);
 }
 
 void bgrInit() {
@@ -1692,7 +2325,7 @@ void dedistortTheta(vector<PolarPoint> &polarPoints, uint16_t robotTheta, uint16
  oldRobotPoint = robotPoint;
 }*/
 
-void writeMapFile(vector<Line> &map, vector<Point> &nodes, vector<array<int, 2>> &links, vector<Point> &wayPoints,
+void writeMapFile(vector<Line> &map, Graph &graph, vector<Point> &wayPoints,
                   Point robotPoint, uint16_t robotTheta, bool mappingEnabled, bool graphingEnabled,
                   bool running, bool patrolling, int select, int mapDiv) {
  FileStorage fs(MAPFILE, FileStorage::WRITE);
@@ -1710,10 +2343,12 @@ void writeMapFile(vector<Line> &map, vector<Point> &nodes, vector<array<int, 2>>
   fs << "]";
 
   fs << "nodes" << "[";
-  for(int i = 0; i < nodes.size(); i++)
-   fs << nodes[i];
+  for(int i = 0; i < graph.nodes.size(); i++)
+   fs << graph.nodes[i];
   fs << "]";
 
+  vector<array<int, 2>> links;
+  graphLinks(graph, links);
   fs << "links" << "[";
   for(int i = 0; i < links.size(); i++) {
    fs << "[";
@@ -1743,7 +2378,7 @@ void writeMapFile(vector<Line> &map, vector<Point> &nodes, vector<array<int, 2>>
   fprintf(stderr, "Error writing map file\n");
 }
 
-void readMapFile(vector<Line> &map, vector<Point> &nodes, vector<array<int, 2>> &links, vector<Point> &wayPoints,
+void readMapFile(vector<Line> &map, Graph &graph, vector<Point> &wayPoints,
                  Point &robotPoint, uint16_t &robotTheta, bool &mappingEnabled, bool &graphingEnabled,
                  bool &running, bool &patrolling, int &select, int &mapDiv) {
  FileStorage fs(MAPFILE, FileStorage::READ);
@@ -1764,7 +2399,7 @@ void readMapFile(vector<Line> &map, vector<Point> &nodes, vector<array<int, 2>>
    FileNode item = *it;
    Point point;
    item >> point;
-   nodes.push_back(point);
+   addGraphNode(graph, point);
   }
 
   FileNode fn3 = fs["links"];
@@ -1774,7 +2409,7 @@ void readMapFile(vector<Line> &map, vector<Point> &nodes, vector<array<int, 2>>
    int b;
    item[0] >> a;
    item[1] >> b;
-   links.push_back({a, b});
+   addGraphLink(graph, a, b);
   }
 
   FileNode fn4 = fs["wayPoints"];
@@ -1800,10 +2435,11 @@ void readMapFile(vector<Line> &map, vector<Point> &nodes, vector<array<int, 2>>
   fprintf(stderr, "Error reading map file\n");
 }
 
-bool gotoPoint(Point targetPoint, int8_t &vy, int8_t &vz, Point robotPoint, uint16_t robotTheta) {
+bool gotoPoint(Point targetPoint, int8_t &vy, int8_t &vz, Point robotPoint, uint16_t robotTheta, double dt) {
  Point deltaPoint = targetPoint - robotPoint;
  int dist = int(sqrt(sqNorm(deltaPoint)));
- static int integTheta = 0;
+ double ticks = dt * CONTROLREFERENCERATE;                   // Pas de temps exprimé en périodes de réglage
+ static double integTheta = 0;
  static int16_t oldDeltaTheta = 0;
 
  if(dist <= GOTOPOINTDISTTOLERANCE) {
@@ -1823,16 +2459,16 @@ bool gotoPoint(Point targetPoint, int8_t &vy, int8_t &vz, Point robotPoint, uint
  if(deltaTheta >= 0 && oldDeltaTheta < 0 ||
     deltaTheta <= 0 && oldDeltaTheta > 0)
   integTheta = 0;
- integTheta += deltaTheta;
- integTheta = constrain(integTheta, -GOTOPOINTVELOCITYTHETA * KITHETA, GOTOPOINTVELOCITYTHETA * KITHETA);
+ integTheta += deltaTheta * ticks;
+ integTheta = constrain(integTheta, -GOTOPOINTVELOCITYTHETA * KITHETA * 1.0, GOTOPOINTVELOCITYTHETA * KITHETA * 1.0);
 
- int16_t derivTheta = deltaTheta - oldDeltaTheta;
+ double derivTheta = int16_t(deltaTheta - oldDeltaTheta) / ticks;
  oldDeltaTheta = deltaTheta;
 
  vy = constrain(GOTOPOINTVELOCITY - abs(deltaTheta) * GOTOPOINTVELOCITY * 180 / PI16 / GOTOPOINTANGLESTOP, 0, GOTOPOINTVELOCITY);
  if(reverseGear)
   vy = -vy;
- vz = constrain(deltaTheta / KPTHETA + integTheta / KITHETA + derivTheta / KDTHETA, -GOTOPOINTVELOCITYTHETA, GOTOPOINTVELOCITYTHETA);
+ vz = constrain(int(deltaTheta / KPTHETA + integTheta / KITHETA + derivTheta / KDTHETA), -GOTOPOINTVELOCITYTHETA, GOTOPOINTVELOCITYTHETA);
 
  return false;
 }
@@ -1849,7 +2485,7 @@ bool gotoPoint(Point targetPoint, int8_t &vy, int8_t &vz, Point robotPoint, uint
  return -1;
 }*/
 
-void patrol(vector<Point> &nodes, vector<array<int, 2>> &links, vector<int> &paths, vector<int> &dists,
+void patrol(Graph &graph, vector<int> &paths, vector<int> &dists,
             vector<Point> &wayPoints, Point &targetPoint, int &targetNode, Point robotPoint, bool patrolling) {
 
  static int wayPoint = 0;
@@ -1868,16 +2504,17 @@ void patrol(vector<Point> &nodes, vector<array<int, 2>> &links, vector<int> &pat
 
  targetPoint = wayPoints[wayPoint];
 
- if(!nodes.empty() && targetPoint != oldTargetPoint) {
+ if(!graph.nodes.empty() && targetPoint != oldTargetPoint) {
   oldTargetPoint = targetPoint;
-  targetNode = closestPoint(nodes, targetPoint);
-  computePaths(nodes, links, targetNode, paths, dists);
+  targetNode = closestPoint(graph.nodes, targetPoint);
+  computePaths(graph, targetNode, paths, dists);
  }
 }
 
-void autopilot(vector<Point> &mapPoints, vector<Point> &nodes, vector<array<int, 2>> &links, vector<int> &paths, vector<int> &dists,
-               Point targetPoint, int &targetNode, int closestRobot, Point &robotPoint, uint16_t &robotTheta, bool running) {
+void autopilot(vector<Point> &mapPoints, Graph &graph, vector<int> &paths, vector<int> &dists,
+               Point targetPoint, int &targetNode, int closestRobot, Point robotPoint, uint16_t robotTheta, bool running, double dt) {
 
+ vector<Point> &nodes = graph.nodes;
  static int state = GOTOPOINT;
  static Point oldTargetPoint = robotPoint;
  static int currentNode = closestRobot;
@@ -1911,14 +2548,11 @@ void autopilot(vector<Point> &mapPoints, vector<Point> &nodes, vector<array<int,
   case GOTONODE:
    if(obstacle(mapPoints, robotPoint, nodes[currentNode],
                int(sqrt(sqDist(robotPoint, nodes[currentNode]))) + OBSTACLEROBOTLENGTH)) {
-    //delLinkAndNodes(nodes, links, closestRobot, currentNode);
-    delNodeAndLinks(nodes, links, currentNode);
-    if(!nodes.empty()) {
-     targetNode = closestPoint(nodes, targetPoint);
-     computePaths(nodes, links, targetNode, paths, dists);
+    //delLinkAndNodes(graph, closestRobot, currentNode);
+    delNodeAndLinks(graph, currentNode, targetPoint, targetNode, paths, dists);
+    if(!nodes.empty())
      currentNode = closestPoint(nodes, robotPoint);
-    }
-   } else if(gotoPoint(nodes[currentNode], vy, vz, robotPoint, robotTheta)) {
+   } else if(gotoPoint(nodes[currentNode], vy, vz, robotPoint, robotTheta, dt)) {
     if(currentNode == targetNode)
      state = GOTOPOINT;
     else
@@ -1932,7 +2566,7 @@ void autopilot(vector<Point> &mapPoints, vector<Point> &nodes, vector<array<int,
     if(dist > DISTFROMOBSTACLE)
      dist = DISTFROMOBSTACLE;
     if(obstacle(mapPoints, robotPoint, targetPoint, dist) ||
-       gotoPoint(targetPoint, vy, vz, robotPoint, robotTheta))
+       gotoPoint(targetPoint, vy, vz, robotPoint, robotTheta, dt))
      state = GOTOWAITING;
     else
      break;
@@ -1953,57 +2587,678 @@ void autopilot(vector<Point> &mapPoints, vector<Point> &nodes, vector<array<int,
  telemetryFrame.vx = vx;
  telemetryFrame.vy = vy;
  telemetryFrame.vz = vz;
+}
+
+void odometry(Point &robotPoint, uint16_t &robotTheta, double dt) {
+ double ticks = dt * CONTROLREFERENCERATE;
+ static double remainderX = 0;                               // Fractions de millimètre conservées d'une période à l'autre
+ static double remainderY = 0;
 
 #ifndef IMU
- robotTheta += vz * VZMUL;
+ static double remainderTheta = 0;
+ double theta = telemetryFrame.vz * VZMUL * ticks + remainderTheta;
+ remainderTheta = theta - int(theta);
+ robotTheta += int(theta);
 #endif
 
- Point point = rotate(Point(vx, vy), robotTheta);
- point.x /= VXDIV;
- point.y /= VYDIV;
- robotPoint += point;
+ double vx = telemetryFrame.vx * ticks / VXDIV;
+ double vy = telemetryFrame.vy * ticks / VYDIV;
+ double x = (vx * cos16(robotTheta) - vy * sin16(robotTheta)) / ONE16 + remainderX;
+ double y = (vx * sin16(robotTheta) + vy * cos16(robotTheta)) / ONE16 + remainderY;
+ remainderX = x - int(x);
+ remainderY = y - int(y);
+ robotPoint += Point(int(x), int(y));
 }
 
-void mapIntersects(vector<Line> &map) {
- bool sort = false;
+void intersectCandidates(MapIndex &index, const LineMap &map, int i, int after, vector<int> &candidates) {
+ if(sqDist(map.lines[i]) < MAPLINESMINLEN * MAPLINESMINLEN) { // Supprimée dès la première intersection, même lointaine
+  candidates.clear();
+  for(int j = after + 1; j < map.lines.size(); j++)
+   candidates.push_back(j);
+  return;
+ }
 
- for(int i = 0; i < map.size(); i++) {
-  if(map[i].validation < VALIDATIONFILTERKEEP)
+ queryEnds(index, map.lines[i], MAPLINESMINLEN * 2, candidates);
+ candidates.erase(candidates.begin(), upper_bound(candidates.begin(), candidates.end(), after));
+}
+
+void mapIntersects(LineMap &map) {
+ vector<Line> &lines = map.lines;
+ vector<bool> work;
+ vector<int> anchors;
+ vector<int> candidates;
+ map.maintaining = true;
+ dirtyLines(map, MAPLINESMINLEN * 2, work, anchors);          // Une extrémité déplacée est à moins de MAPLINESMINLEN de l'autre ligne
+
+ for(int i : anchors) {
+  if(map.erased[i] || lines[i].validation < VALIDATIONFILTERKEEP)
    continue;
 
-  for(int j = 0; j < map.size(); j++) {
-   if(i == j || map[j].validation < VALIDATIONFILTERKEEP)
+  Line before = lines[i];
+  intersectCandidates(map.index, map, i, -1, candidates);
+  for(int k = 0; k < candidates.size() && !work[i]; k++)     // Les coins voisins s'enchaînent, tous sont revus
+   work[i] = map.dirty[candidates[k]] != LINECLEAN;
+
+  for(int k = 0; k < candidates.size(); k++) {
+   int j = candidates[k];
+   if(i == j || map.erased[j] || lines[j].validation < VALIDATIONFILTERKEEP || !work[i])
     continue;
 
    Point intersectPoint;
-   if(!intersectLine(map[i], map[j], intersectPoint))
+   if(!intersectLine(lines[i], lines[j], intersectPoint))
+    continue;
+
+   Point a = lines[i].a;
+   Point b = lines[i].b;
+   bool moved = false;
+   if(testPointLine(lines[i].a, lines[j], MAPLINESMINLEN, MAPLINESMINLEN) &&
+      sqDist(lines[i].a, intersectPoint) < MAPLINESMINLEN * MAPLINESMINLEN) {
+    lines[i].a = intersectPoint;
+    moved = true;
+   }
+
+   if(testPointLine(lines[i].b, lines[j], MAPLINESMINLEN, MAPLINESMINLEN) &&
+      sqDist(lines[i].b, intersectPoint) < MAPLINESMINLEN * MAPLINESMINLEN) {
+    lines[i].b = intersectPoint;
+    moved = true;
+   }
+
+   if(sqDist(lines[i]) < MAPLINESMINLEN * MAPLINESMINLEN) {
+    eraseLine(map, i);
+    break;
+   }
+
+   if(moved) {                                               // Les extrémités ont changé, nouveaux voisins après j
+    if(lines[i].a != a || lines[i].b != b)
+     insertIndex(map.index, i, lines[i].a, lines[i].b);
+    intersectCandidates(map.index, map, i, j, candidates);
+    k = -1;
+   }
+  }
+
+  if(!map.erased[i] && (lines[i].a != before.a || lines[i].b != before.b)) // Souvent revenue à sa place après plusieurs coins
+   touchLine(map, i);
+ }
+}
+
+#ifdef EXTRACTORSTATSPERIOD
+void reportExtractorStats() {
+ uint64_t now = getTimeNs(CLOCK_MONOTONIC);
+
+ if(!extractorStats.start) {
+  extractorStats.start = now;
+  return;
+ }
+
+ if(now - extractorStats.start < uint64_t(EXTRACTORSTATSPERIOD) * 1000000000)
+  return;
+
+ if(extractorStats.scans)
+  fprintf(stderr, "Extractor %s | %d us CPU/scan | %.1f lines/scan\n", EXTRACTORS[extractor],
+          int(extractorStats.cpuTime / 1000 / extractorStats.scans), double(extractorStats.lines) / extractorStats.scans);
+
+ extractorStats = {};
+ extractorStats.start = now;
+}
+#endif
+
+#ifdef LOCALIZATIONSTATSPERIOD
+void reportLocalizationStats() {
+ uint64_t now = getTimeNs(CLOCK_MONOTONIC);
+
+ if(!localizationStats.start) {
+  localizationStats.start = now;
+  return;
+ }
+
+ if(now - localizationStats.start < uint64_t(LOCALIZATIONSTATSPERIOD) * 1000000000)
+  return;
+
+ if(localizationStats.scans)
+  fprintf(stderr, "Localization %s | %d us CPU/scan | %d %% confidence\n", ENGINES[engine],
+          int(localizationStats.cpuTime / 1000 / localizationStats.scans), localizationStats.confidence / localizationStats.scans);
+
+ localizationStats = {};
+ localizationStats.start = now;
+}
+#endif
+
+void pushMapEdit(const MapEdit &edit) {                      // Sous world.mutex
+ world.mapEdits.push_back(edit);
+ if(world.mapEdits.size() <= MAPEDITSMAX)
+  return;
+
+ for(auto it = world.mapEdits.begin(); it != world.mapEdits.end(); it++) {
+  if(it->scan) {                                             // Entretien en retard, le plus ancien scan n'est pas cartographié
+   world.mapEdits.erase(it);
+   break;
+  }
+ }
+}
+
+bool pendingMapReplace() {                                   // Sous world.mutex
+ for(const MapEdit &edit : world.mapEdits)
+  if(edit.map)
+   return true;
+ return false;
+}
+
+void localizationThread() {
+ fprintf(stderr, "Localization thread starting\n");
+ uint32_t sequence = 0;
+ MapIndex mapIndex;
+ vector<int> mapOrder;
+ DistanceField mapField;
+ vector<array<int, 4>> fieldLines;
+ shared_ptr<const vector<Line>> indexedMap;
+ RelocGrid relocGrid = {};
+ shared_ptr<const vector<Line>> relocMap;
+ int lostScans = 0;
+
+ while(run) {
+  readEvent(lidarEvent);
+  if(!run)
+   break;
+  if(!consumeScan(lidarScans))
+   continue;
+
+  shared_ptr<ScanSnapshot> scan = make_shared<ScanSnapshot>();
+  shared_ptr<const vector<Line>> map;
+  Point robotPoint;
+  uint16_t robotTheta;
+  uint16_t oldRobotTheta;
+
+  {
+   lock_guard<mutex> lock(world.mutex);
+#ifdef IMU
+   world.robotTheta = angleDoubleToAngle16(imuData.fusionPose.z() * DIRZ) + robotThetaCorrector;
+#endif
+   robotPoint = world.robotPoint;
+   robotTheta = world.robotTheta;
+   oldRobotTheta = world.oldRobotTheta;
+   world.oldRobotTheta = robotTheta;
+   map = world.mapSnapshot;
+  }
+  Point startPoint = robotPoint;
+  uint16_t startTheta = robotTheta;
+
+  vector<PolarPoint> &polarPoints = scan->polarPoints;
+  polarPoints = lidarScans.scans[lidarScans.front].points;
+  dedistortTheta(polarPoints, robotTheta, oldRobotTheta);
+
+  ScanPoints scanPoints;
+  loadScan(polarPoints, scanPoints);
+  polarToRobot(scanPoints);
+  storePoints(scanPoints.robotX.data(), scanPoints.robotY.data(), scanPoints.size, scan->robotPoints);
+
+#ifdef EXTRACTORSTATSPERIOD
+  uint64_t cpuStart = getTimeNs(CLOCK_THREAD_CPUTIME_ID);
+#endif
+
+  vector<Line> robotLines;
+  if(extractor == EXTRACTORSTREAMING)
+   extractLinesStreaming(polarPoints, scan->robotPoints, robotLines);
+  else {
+   vector<vector<Point>> robotRawLines;
+   extractRawLinesMike118(polarPoints, scan->robotPoints, robotRawLines);
+   fitLines(robotRawLines, robotLines);
+  }
+
+#ifdef EXTRACTORSTATSPERIOD
+  extractorStats.cpuTime += getTimeNs(CLOCK_THREAD_CPUTIME_ID) - cpuStart;
+  extractorStats.scans++;
+  extractorStats.lines += robotLines.size();
+  reportExtractorStats();
+#endif
+
+  int confidences[AXES] = {0};
+  scan->lines = !robotLines.empty();
+  if(scan->lines) {
+   sortLines(robotLines);
+   splitAxes(robotLines, scan->robotLinesAxes);
+
+#ifdef LOCALIZATIONSTATSPERIOD
+   uint64_t localizationStart = getTimeNs(CLOCK_THREAD_CPUTIME_ID);
+#endif
+
+   if(map != indexedMap) {                                   // Nouvel instantané de la carte
+    if(engine == ENGINEFIELD)
+     updateMapField(mapField, fieldLines, *map);
+    else
+     buildOrderedIndex(mapIndex, mapOrder, *map);
+    indexedMap = map;
+   }
+
+   if(engine == ENGINEFIELD)
+    localizationField(scan->robotPoints, mapField, confidences, robotPoint, robotTheta);
+   else
+    localization(scan->robotLinesAxes, *map, mapOrder, mapIndex, confidences, robotPoint, robotTheta);
+
+#ifdef LOCALIZATIONSTATSPERIOD
+   localizationStats.cpuTime += getTimeNs(CLOCK_THREAD_CPUTIME_ID) - localizationStart;
+   localizationStats.scans++;
+   localizationStats.confidence += min(confidences[0], confidences[1]);
+   reportLocalizationStats();
+#endif
+
+   if(max(confidences[0], confidences[1]) <= RECOVERYCONFIDENCE)
+    lostScans++;
+   else
+    lostScans = 0;
+
+   if(lostScans >= RELOCSCANS && !map->empty()) {          // Suivi perdu, recherche globale dans la carte
+    relocalization(scan->robotPoints, *map, mapField, fieldLines, relocGrid, map != relocMap, robotPoint, robotTheta);
+    relocMap = map;
+    lostScans = 0;
+   }
+
+   scanToMap(scanPoints, robotPoint, robotTheta);
+   storePoints(scanPoints.mapX.data(), scanPoints.mapY.data(), scanPoints.size, scan->mapPoints);
+   robotToMap(robotLines, scan->mapLines, robotPoint, robotTheta);
+  }
+  scan->robotPoint = robotPoint;
+  scan->robotTheta = robotTheta;
+  scan->sequence = ++sequence;
+
+  {
+   lock_guard<mutex> lock(world.mutex);
+   world.robotPoint += robotPoint - startPoint;             // L'odométrie a pu avancer pendant le calcul
+   world.robotTheta += robotTheta - startTheta;
+   if(scan->lines) {
+    for(int i = 0; i < AXES; i++)
+     world.confidences[i] = confidences[i];
+   }
+   world.scan = scan;
+   pushMapEdit({scan, NULL});
+  }
+  world.changed.notify_all();
+
+  if(replayFast) {                                           // Rejeu déterministe : attendre les autres étages
+   unique_lock<mutex> lock(world.mutex);
+   while(run && (world.mapped != sequence || world.planned != sequence))
+    world.changed.wait_for(lock, chrono::milliseconds(STAGETIMEOUT));
+   lock.unlock();
+   writeEvent(replayEvent);
+  }
+ }
+
+ fprintf(stderr, "Localization thread stopping\n");
+}
+
+shared_ptr<const ScanSnapshot> waitScan(uint32_t sequence) {
+ unique_lock<mutex> lock(world.mutex);
+ while(run && (!world.scan || world.scan->sequence == sequence))
+  world.changed.wait_for(lock, chrono::milliseconds(STAGETIMEOUT));
+
+ if(!run)
+  return NULL;
+ return world.scan;
+}
+
+void mappingThread() {                                       // Seul à modifier la carte, les autres étages lisent ses instantanés
+ fprintf(stderr, "Mapping thread starting\n");
+ LineMap lineMap;                                            // Gardée ouverte d'un scan à l'autre, compactée seulement au-delà d'un seuil
+ vector<Line> map;
+ openLineMap(lineMap, map);
+ bool modified = false;                                      // Modifications pas encore publiées
+ uint64_t published = 0;
+
+ while(run) {
+  deque<MapEdit> edits;
+  bool enabled;
+  {
+   unique_lock<mutex> lock(world.mutex);
+   while(run && world.mapEdits.empty()) {
+    world.changed.wait_for(lock, chrono::milliseconds(modified ? MAPSNAPSHOTPERIOD : STAGETIMEOUT));
+    if(modified)                                             // Publier la carte même sans nouveau scan
+     break;
+   }
+   edits.swap(world.mapEdits);
+   enabled = world.mappingEnabled;
+  }
+  if(!run)
+   break;
+
+  uint32_t sequence = 0;
+  for(const MapEdit &edit : edits) {
+   if(edit.map) {                                            // Déjà publiée par l'interface, les scans suivants s'y appliquent
+    map = *edit.map;
+    openLineMap(lineMap, map);
+    modified = false;
+    continue;
+   }
+
+   sequence = edit.scan->sequence;
+   if(!enabled || !edit.scan->lines)
     continue;
 
-   if(testPointLine(map[i].a, map[j], MAPLINESMINLEN, MAPLINESMINLEN) &&
-      sqDist(map[i].a, intersectPoint) < MAPLINESMINLEN * MAPLINESMINLEN) {
-    map[i].a = intersectPoint;
-    sort = true;
+   vector<Line> mapLines = edit.scan->mapLines;
+   vector<PolarPoint> polarPoints = edit.scan->polarPoints;
+   mapping(mapLines, lineMap);
+   mapCleaner(polarPoints, lineMap, edit.scan->robotPoint, edit.scan->robotTheta);
+   mapDeduplicateAverage(lineMap);
+   mapDeduplicateErase(lineMap);
+   mapIntersects(lineMap);
+   mapFiltersDecay(lineMap);
+   settleLineMap(lineMap);
+   compactLineMap(lineMap);
+   modified = true;
+  }
+
+  shared_ptr<const vector<Line>> snapshot;
+  uint64_t now = getTimeNs(CLOCK_MONOTONIC);
+  bool publish = replayFast || now - published >= uint64_t(MAPSNAPSHOTPERIOD) * 1000000; // À chaque scan en relecture rapide
+  if(modified && publish) {                                  // Copiée hors du verrou, les lecteurs gardent l'instantané qu'ils tiennent
+   packLineMap(lineMap, map);
+   snapshot = make_shared<const vector<Line>>(move(map));
+   modified = false;
+   published = now;
+  }
+
+  {
+   lock_guard<mutex> lock(world.mutex);
+   if(snapshot && !pendingMapReplace())                      // Sinon ce résultat serait remplacé par la carte de l'interface
+    world.mapSnapshot = snapshot;
+   if(sequence)
+    world.mapped = sequence;
+  }
+  world.changed.notify_all();
+ }
+
+ fprintf(stderr, "Mapping thread stopping\n");
+}
+
+void planningThread() {
+ fprintf(stderr, "Planning thread starting\n");
+ uint32_t sequence = 0;
+ int slowdown = 0;
+
+ while(run) {
+  shared_ptr<const ScanSnapshot> scan = waitScan(sequence);
+  if(!scan)
+   break;
+  sequence = scan->sequence;
+
+  Graph graph = {};
+  vector<int> paths;
+  vector<int> dists;
+  Point targetPoint;
+  int targetNode = 0;
+  uint32_t version = 0;
+  bool enabled;
+  {
+   lock_guard<mutex> lock(world.mutex);
+   enabled = world.graphingEnabled && scan->lines;
+   if(enabled) {                                             // Ralenti avant la copie du graphe, pas après
+    if(slowdown++ == GRAPHINGSLOWDOWN)
+     slowdown = 0;
+    else
+     enabled = false;
+   }
+   if(enabled) {
+    graph = world.graph;
+    paths = world.paths;
+    dists = world.dists;
+    targetPoint = world.targetPoint;
+    targetNode = world.targetNode;
+    version = world.graphVersion;
    }
+  }
+
+  if(enabled) {
+   vector<PolarPoint> polarPoints = scan->polarPoints;
+   vector<Point> mapPoints = scan->mapPoints;
+   graphing(polarPoints, mapPoints, graph, paths, dists, targetPoint, targetNode, scan->robotPoint, scan->robotTheta);
+  }
+
+  {
+   lock_guard<mutex> lock(world.mutex);
+   if(enabled && world.graphVersion == version && graph.nodes.size() != world.graph.nodes.size()) {
+    swap(world.graph, graph);
+    world.paths.swap(paths);
+    world.dists.swap(dists);
+    world.targetNode = targetNode;
+    world.graphVersion++;
+   }
+   if(!world.graph.nodes.empty())
+    world.closestRobot = closestPoint(world.graph.nodes, world.robotPoint);
+   world.planned = sequence;
+  }
+  world.changed.notify_all();
+ }
+
+ fprintf(stderr, "Planning thread stopping\n");
+}
+
+void benchmarkPoints(int iterations) {
+ vector<PolarPoint> polarPoints;
+ for(int i = 0; i < BENCHMARKNBPOINTS; i++)
+  polarPoints.push_back({DISTANCEMIN + rand() % BENCHMARKDISTANCEMAX, uint16_t(i * 0x10000 / BENCHMARKNBPOINTS)});
+ Point robotPoint = Point(1234, -567);
+ uint16_t robotTheta = 12345;
+
+ ScanPoints scanPoints;
+ vector<Point> robotPoints;
+ vector<Point> mapPoints;
+ vector<Point> kernelRobotPoints;
+ vector<Point> kernelMapPoints;
+ TickMeter referenceMeter;
+ TickMeter kernelMeter;
+
+ for(int i = 0; i < iterations; i++) {
+  robotPoints.clear();
+  mapPoints.clear();
+  referenceMeter.start();
+  lidarToRobot(polarPoints, robotPoints);
+  robotToMap(robotPoints, mapPoints, robotPoint, robotTheta);
+  referenceMeter.stop();
+
+  kernelRobotPoints.clear();
+  kernelMapPoints.clear();
+  kernelMeter.start();
+  loadScan(polarPoints, scanPoints);
+  polarToRobot(scanPoints);
+  scanToMap(scanPoints, robotPoint, robotTheta);
+  storePoints(scanPoints.robotX.data(), scanPoints.robotY.data(), scanPoints.size, kernelRobotPoints);
+  storePoints(scanPoints.mapX.data(), scanPoints.mapY.data(), scanPoints.size, kernelMapPoints);
+  kernelMeter.stop();
+ }
+
+ int errors = 0;
+ for(int i = 0; i < BENCHMARKNBPOINTS; i++) {
+  if(robotPoints[i] != kernelRobotPoints[i] || mapPoints[i] != kernelMapPoints[i])
+   errors++;
+ }
+
+ fprintf(stderr, "%d points per scan, %d scans\n", BENCHMARKNBPOINTS, iterations);
+ fprintf(stderr, "Per point conversion %.2f us per scan\n", referenceMeter.getTimeMicro() / iterations);
+ fprintf(stderr, "%s batch kernels %.2f us per scan\n", POINTSKERNEL, kernelMeter.getTimeMicro() / iterations);
+ fprintf(stderr, "%d points differ\n", errors);
+}
+
+void benchmarkMaintenance(vector<Line> &mapLines, vector<Line> &map) {
+ LineMap lineMap;
+ openLineMap(lineMap, map);
+ mapping(mapLines, lineMap);
+ mapDeduplicateAverage(lineMap);
+ mapDeduplicateErase(lineMap);
+ mapIntersects(lineMap);
+ closeLineMap(lineMap, map);
+}
+
+void benchmarkMap(int iterations) {
+ const int sizes[] = {100, 300, 1000, 3000, 10000, 20000};
+
+ for(int size : sizes) {
+  int cells = int(ceil(sqrt(size / 2.0)));                   // Bâtiment en damier, deux murs par pièce
+  int spacing = BENCHMARKMAPSIDE / cells;
+  vector<Line> map;
+  for(int i = 0; i < size; i++) {
+   int cell = i / 2;
+   Point corner = Point(cell % cells * spacing + rand() % 41 - 20, cell / cells * spacing + rand() % 41 - 20);
+   int start = rand() % (spacing / 4);                       // Ouvertures aux extrémités
+   int end = spacing - rand() % (spacing / 4);
+   Point a = i % 2 ? corner + Point(start, 0) : corner + Point(0, start);
+   Point b = i % 2 ? corner + Point(end, rand() % 41 - 20) : corner + Point(rand() % 41 - 20, end);
+   Line line = {a, b};
+   line.validation = VALIDATIONFILTERKEEP;
+   line.intega = a;
+   line.integb = b;
+   line.integ = 1;
+   line.shrinka = SHRINKFILTER;
+   line.shrinkb = SHRINKFILTER;
+   map.push_back(line);
+  }
+
+  for(int i = 0; i < BENCHMARKSETTLEPASSES; i++) {           // Les coins se rejoignent en quelques passes
+   vector<Line> noLines;
+   benchmarkMaintenance(noLines, map);
+  }
+  size = map.size();
+
+  vector<Line> mapLines;
+  for(int i = 0; i < BENCHMARKNBLINES; i++) {
+   Line line = map[rand() % size];
+   line.a += Point(rand() % 101 - 50, rand() % 101 - 50);
+   line.b += Point(rand() % 101 - 50, rand() % 101 - 50);
+   mapLines.push_back(line);
+  }
 
-   if(testPointLine(map[i].b, map[j], MAPLINESMINLEN, MAPLINESMINLEN) &&
-      sqDist(map[i].b, intersectPoint) < MAPLINESMINLEN * MAPLINESMINLEN) {
-    map[i].b = intersectPoint;
-    sort = true;
+  TickMeter bruteMeter;
+  TickMeter buildMeter;
+  TickMeter indexMeter;
+  TickMeter maintenanceMeter;
+  TickMeter fullMeter;
+  TickMeter fieldMeter;
+  TickMeter updateMeter;
+  MapIndex index;
+  vector<int> order;
+  int errors = 0;
+
+  for(int i = 0; i < iterations; i++) {
+   buildMeter.start();
+   buildOrderedIndex(index, order, map);
+   buildMeter.stop();
+
+   for(int j = 0; j < NBITERATIONS * AXES; j++) {            // Autant d'appels que localization() par scan
+    int distTolerance = LARGEDISTTOLERANCE / (j / AXES + 1);
+    double angularTolerance = LARGEANGULARTOLERANCE / (j / AXES + 1);
+    Point bruteError;
+    Point indexError;
+    double bruteAngularError = 0.0;
+    double indexAngularError = 0.0;
+    int bruteConfidence;
+    int indexConfidence;
+
+    bruteMeter.start();
+    computeErrors(mapLines, map, order, NULL, bruteError, bruteAngularError, bruteConfidence, distTolerance, angularTolerance);
+    bruteMeter.stop();
+
+    indexMeter.start();
+    computeErrors(mapLines, map, order, &index, indexError, indexAngularError, indexConfidence, distTolerance, angularTolerance);
+    indexMeter.stop();
+
+    if(bruteError != indexError || bruteAngularError != indexAngularError || bruteConfidence != indexConfidence)
+     errors++;
    }
 
-   if(sqDist(map[i]) < MAPLINESMINLEN * MAPLINESMINLEN) {
-    map.erase(map.begin() + i);
-    if(j >= i)
-     j--;
-    i--;
-    sort = false;
+   vector<Line> copy = map;
+   vector<Line> copyLines = mapLines;
+   for(int j = 0; j < copy.size(); j++)                      // Toute la carte à revoir, comme une carte relue
+    copy[j].settled = false;
+   fullMeter.start();
+   benchmarkMaintenance(copyLines, copy);
+   fullMeter.stop();
+
+   copy = map;
+   copyLines = mapLines;
+   maintenanceMeter.start();
+   benchmarkMaintenance(copyLines, copy);
+   maintenanceMeter.stop();
+
+   DistanceField field;
+   vector<array<int, 4>> fieldLines;
+   fieldMeter.start();
+   updateMapField(field, fieldLines, copy);
+   fieldMeter.stop();
+
+   copyLines = mapLines;                                     // Scan suivant sur une carte déjà entretenue
+   benchmarkMaintenance(copyLines, copy);
+   updateMeter.start();
+   updateMapField(field, fieldLines, copy);
+   updateMeter.stop();
+
+   DistanceField reference;                                  // Le champ mis à jour doit être identique à un champ reconstruit
+   vector<array<int, 4>> referenceLines;
+   updateMapField(reference, referenceLines, copy);
+   for(int j = 0; j < BENCHMARKFIELDSAMPLES; j++) {
+    double x = rand() % (BENCHMARKMAPSIDE + FIELDMAXDIST * 2) - FIELDMAXDIST;
+    double y = rand() % (BENCHMARKMAPSIDE + FIELDMAXDIST * 2) - FIELDMAXDIST;
+    double dist[2];
+    double gradX[2];
+    double gradY[2];
+    sampleField(field, x, y, dist[0], gradX[0], gradY[0]);
+    sampleField(reference, x, y, dist[1], gradX[1], gradY[1]);
+    if(dist[0] != dist[1] || gradX[0] != gradX[1] || gradY[0] != gradY[1])
+     errors++;
    }
+  }
+
+  fprintf(stderr, "%5d lines | exhaustive %.0f us/scan | index %.0f us/scan + %.0f us build | maintenance %.0f us, %.0f us full | field %.0f us build, %.0f us update | %d differ\n",
+          size, bruteMeter.getTimeMicro() / iterations, indexMeter.getTimeMicro() / iterations,
+          buildMeter.getTimeMicro() / iterations, maintenanceMeter.getTimeMicro() / iterations,
+          fullMeter.getTimeMicro() / iterations, fieldMeter.getTimeMicro() / iterations, updateMeter.getTimeMicro() / iterations, errors);
+ }
+}
+
+void controlThread() {
+ fprintf(stderr, "Control thread starting at %d Hz\n", controlRate);
 
+ int epfd = createLoop();
+ int timer = createTimer(controlRate);
+ addToLoop(epfd, timer, EVENTFRAME);
+
+ vector<Point> mapPoints;
+ uint32_t sequence = 0;
+
+ while(run) {
+  int ids[NBEVENTSMAX];
+  if(!waitLoop(epfd, ids, LOOPTIMEOUT))
+   continue;
+
+  uint64_t expirations = readEvent(timer);                   // Supérieur à 1 si une période a été manquée
+  if(!expirations)
+   continue;
+  double dt = double(expirations) / controlRate;
+
+  lock_guard<mutex> lock(world.mutex);
+
+  if(world.scan && world.scan->sequence != sequence) {
+   sequence = world.scan->sequence;
+   if(world.scan->lines)
+    mapPoints = world.scan->mapPoints;
   }
+
+#ifdef IMU
+  world.robotTheta = angleDoubleToAngle16(imuData.fusionPose.z() * DIRZ) + robotThetaCorrector;
+#endif
+
+  int nodesSize = world.graph.nodes.size();
+  int oldTargetNode = world.targetNode;
+
+  autopilot(mapPoints, world.graph, world.paths, world.dists,
+            world.targetPoint, world.targetNode, world.closestRobot, world.robotPoint, world.robotTheta, world.running, dt);
+
+  odometry(world.robotPoint, world.robotTheta, dt);
+
+  if(world.graph.nodes.size() != nodesSize || world.targetNode != oldTargetNode)
+   world.graphVersion++;
  }
 
- if(sort)
-  sortLines(map);
+ close(timer);
+ close(epfd);
+
+ fprintf(stderr, "Control thread stopping\n");
 }
 
 int main(int argc, char* argv[]) {
@@ -2011,93 +3266,227 @@ int main(int argc, char* argv[]) {
 
  signal(SIGTERM, signal_callback_handler);
 
- if(argc != 4) {
+ const char *recordPath = NULL;
+ const char *replayPath = NULL;
+ bool recordCamera = false;
+ int outputMode = OUTPUTPIPE;
+ int benchmarkIterations = 0;
+ EncoderSettings encoderSettings = {0, ENCODERBITRATE, ENCODERKEYFRAMES};
+ int opt;
+
+ while((opt = getopt(argc, argv, "r:cp:fyse:b:g:t:m:l:a:")) != -1) {
+  switch(opt) {
+   case 'r':
+    recordPath = optarg;
+    break;
+   case 'c':
+    recordCamera = true;
+    break;
+   case 'p':
+    replayPath = optarg;
+    break;
+   case 'f':
+    replayFast = true;
+    break;
+   case 'y':
+    yuv = true;
+    break;
+   case 's':
+    outputMode = OUTPUTSHM;
+    break;
+   case 'e':
+    outputMode = OUTPUTH264;
+    sscanf(optarg, "%d", &encoderSettings.port);
+    break;
+   case 'b':
+    sscanf(optarg, "%d", &encoderSettings.bitrate);
+    break;
+   case 'g':
+    sscanf(optarg, "%d", &encoderSettings.keyframes);
+    break;
+   case 't':
+    sscanf(optarg, "%d", &controlRate);
+    break;
+   case 'm':
+    sscanf(optarg, "%d", &benchmarkIterations);
+    break;
+   case 'l':
+    for(int i = 0; i < NBEXTRACTORS; i++) {
+     if(!strcmp(optarg, EXTRACTORS[i]))
+      extractor = i;
+    }
+    break;
+   case 'a':
+    for(int i = 0; i < NBENGINES; i++) {
+     if(!strcmp(optarg, ENGINES[i]))
+      engine = i;
+    }
+    break;
+   default:
+    fprintf(stderr, "Usage: %s [-r session [-c]] [-p session [-f]] [-y] [-s | -e port [-b bitrate] [-g keyframes]] [-t rate] [-m iterations] [-l mike118 | streaming] [-a lines | field] [width height fps]\n", argv[0]);
+    return 1;
+  }
+ }
+
+ if(argc - optind != 3) {
   width = WIDTH;
   height = HEIGHT;
   fps = FPS;
  } else {
-  sscanf(argv[1], "%d", &width);
-  sscanf(argv[2], "%d", &height);
-  sscanf(argv[3], "%d", &fps);
+  sscanf(argv[optind], "%d", &width);
+  sscanf(argv[optind + 1], "%d", &height);
+  sscanf(argv[optind + 2], "%d", &fps);
  }
 
- int fd = serialOpen(SERIALPORT, SERIALRATE);
- if(fd == -1) {
-  fprintf(stderr, "Error opening Vigibot serial port\n");
-  return 1;
+ if(controlRate <= 0)
+  controlRate = CONTROLRATE;
+
+ if(benchmarkIterations > 0) {
+  benchmarkPoints(benchmarkIterations);
+  benchmarkMap(benchmarkIterations);
+  return 0;
  }
 
- int ld = serialOpen(LIDARPORT, LIDARRATE);
- if(ld == -1) {
-  fprintf(stderr, "Error opening lidar serial port\n");
-  return 1;
+ int fd;
+ int td;                                                     // Télémétrie, distincte du port série en rejeu
+ int ld;
+
+ if(replayPath) {
+  pipe(replayModem);
+  pipe(replayLidar);
+  replayEvent = createEvent(false);
+  fd = replayModem[0];
+  td = open("/dev/null", O_WRONLY);                          // Le chemin d'écriture de la télémétrie reste exercé
+ } else {
+  fd = serialOpen(SERIALPORT, SERIALRATE);
+  if(fd == -1) {
+   fprintf(stderr, "Error opening Vigibot serial port\n");
+   return 1;
+  }
+  td = fd;
+
+  ld = serialOpen(LIDARPORT, LIDARRATE);
+  if(ld == -1) {
+   fprintf(stderr, "Error opening lidar serial port\n");
+   return 1;
+  }
  }
 
+ if(recordPath && !openRecorder(recordPath))
+  return 1;
+
  FILE *actualStdout = fdopen(dup(STDOUT_FILENO), "a");
  dup2(STDERR_FILENO, STDOUT_FILENO);
 
-#ifdef IMU
- thread imuThr(imuThread);
- while(imuThreadStatus == STATUSWAITING);
- if(imuThreadStatus == STATUSERROR) {
-  fprintf(stderr, "No IMU found\n");
+ int size = imageSize(width, height, yuv);
+ Output output;
+ if(!openOutput(output, outputMode, actualStdout, encoderSettings, width, height, fps, yuv))
   return 1;
+
+#ifdef IMU
+ thread imuThr;
+ if(!replayPath) {
+  imuThr = thread(imuThread);
+  while(imuThreadStatus == STATUSWAITING);
+  if(imuThreadStatus == STATUSERROR) {
+   fprintf(stderr, "No IMU found\n");
+   return 1;
+  }
  }
 #endif
 
- fprintf(stderr, "Starting lidar\n");
- startLidar(ld);
+ lidarEvent = createEvent(false);
+ thread lidarThr;
+ if(replayPath) {
+  fprintf(stderr, "Starting replay\n");
+  lidarThr = thread(replayThread, replayPath);
+ } else {
+  fprintf(stderr, "Starting lidar\n");
+  lidarThr = thread(lidarThread, ld);
+ }
 
  Mat image;
- int size = width * height * 3;
 
  telemetryFrame.header[0] = '$';
  telemetryFrame.header[1] = 'R';
  telemetryFrame.header[2] = ' ';
  telemetryFrame.header[3] = ' ';
 
- vector<PolarPoint> polarPoints;
- vector<Point> robotPoints;
- vector<vector<Point>> robotRawLines;
- vector<Line> robotLines;
+ vector<Point> robotPoints;                                  // Copies du dernier scan pour l'affichage
  vector<Line> robotLinesAxes[AXES];
  vector<Point> mapPoints;
  vector<Line> mapLines;
- vector<Line> map;
- vector<Point> nodes;
- vector<array<int, 2>> links;
+ uint32_t renderedScan = 0;
+
+ vector<Line> map;                                           // Copie de l'instantané pour l'affichage et les éditions de l'interface
+ shared_ptr<const vector<Line>> shownMap;
+
+ Graph graph = {};                                           // Copies de l'état partagé, l'interface dessine et édite sans world.mutex
  vector<int> paths;
  vector<int> dists;
- vector<Point> wayPoints;
-
+ vector<GraphEdit> graphEdits;                               // Éditions de l'opérateur depuis la dernière copie du graphe
+ uint32_t graphVersion = 0;
  Point robotPoint = Point(0, 0);
  uint16_t robotTheta = 0;
+ uint16_t oldRobotTheta;
  bool mappingEnabled = true;
  bool graphingEnabled = false;
  Point targetPoint = Point(0, 0);
  int targetNode = 0;
  int closestRobot = 0;
+ int confidences[AXES] = {0};
+
+ vector<Point> wayPoints;
  bool running = false;
  bool patrolling = false;
  int select = SELECTFIXEDGRAPHING;
  int mapDiv = MAPDIV;
- int confidences[AXES] = {0};
  fprintf(stderr, "Reading map file\n");
- readMapFile(map, nodes, links, wayPoints, robotPoint, robotTheta, mappingEnabled, graphingEnabled, running, patrolling, select, mapDiv);
+ readMapFile(map, graph, wayPoints, robotPoint, robotTheta, mappingEnabled, graphingEnabled, running, patrolling, select, mapDiv);
  Point oldRobotPoint = robotPoint;
- uint16_t oldRobotTheta = robotTheta;
+ oldRobotTheta = robotTheta;
  robotThetaCorrector = robotTheta;
- if(!nodes.empty())
-  computePaths(nodes, links, targetNode, paths, dists);
+ if(!graph.nodes.empty())
+  computePaths(graph, targetNode, paths, dists);
+ shownMap = make_shared<const vector<Line>>(map);
+ world.mapSnapshot = shownMap;
+ pushMapEdit({NULL, shownMap});
+ world.graph = graph;
+ world.paths = paths;
+ world.dists = dists;
+ world.graphVersion = graphVersion;
+ world.robotPoint = robotPoint;
+ world.robotTheta = robotTheta;
+ world.oldRobotTheta = oldRobotTheta;
+ world.mappingEnabled = mappingEnabled;
+ world.graphingEnabled = graphingEnabled;
+ world.running = running;
+ world.targetPoint = targetPoint;
+ world.targetNode = targetNode;
+ world.closestRobot = closestRobot;
+
+ fprintf(stderr, "Starting pipeline stages\n");
+ thread localizationThr(localizationThread);
+ thread mappingThr(mappingThread);
+ thread planningThr(planningThread);
+ thread controlThr(controlThread);
 
  bgrInit();
 
  fprintf(stderr, "Starting capture\n");
  VideoCapture capture;
- capture.open(0);
+ if(!replayPath)
+  capture.open(0);
 
  TickMeter tickMeter;
  int time = 0;
+ Grabber grabber;
+ int timer = -1;
+
+ ModemLink modemLink = {};
+
+ int epfd = createLoop();
+ addToLoop(epfd, fd, EVENTMODEM);
 
  bool captureEnabled = capture.isOpened();
  if(captureEnabled) {
@@ -2105,122 +3494,221 @@ int main(int argc, char* argv[]) {
   capture.set(CAP_PROP_FRAME_WIDTH, width);
   capture.set(CAP_PROP_FRAME_HEIGHT, height);
   capture.set(CAP_PROP_FPS, fps);
- } else
+  startGrabber(grabber, capture, yuv);
+  addToLoop(epfd, grabber.grabbed, EVENTCAPTURE);
+ } else {
   fprintf(stderr, "Error starting capture\n");
+  timer = createTimer(fps);
+  addToLoop(epfd, timer, EVENTFRAME);
+ }
 
  while(run) {
-  if(captureEnabled) {
-   capture.read(image);
-  } else {
-   image = Mat::zeros(Size(width, height), CV_8UC3);
-   int wait = 1000000 / fps - time * 1000;
-   if(wait > 0)
-    usleep(wait);
-  }
-
-  tickMeter.start();
+  int ids[NBEVENTSMAX];
+  int n = waitLoop(epfd, ids, LOOPTIMEOUT);
 
-  bool updated = readModem(fd, remoteFrame);
-
-#ifdef IMU
-  robotTheta = angleDoubleToAngle16(imuData.fusionPose.z() * DIRZ) + robotThetaCorrector;
-#else
-  robotTheta += remoteFrame.vz * VZMUL;
-#endif
+  for(int i = 0; i < n; i++) {
+   switch(ids[i]) {
 
-  Point point = rotate(Point(remoteFrame.vx, remoteFrame.vy), robotTheta);
-  point.x /= VXDIV;
-  point.y /= VYDIV;
-  robotPoint += point;
+    case EVENTMODEM: {
+     lock_guard<mutex> lock(world.mutex);                    // Trames partagées avec le thread de contrôle
+     if(readModem(fd, modemLink, remoteFrame)) {
+      recordSession(SESSIONREMOTE, remoteFrame.bytes, REMOTEFRAMESIZE, NULL, 0);
 
-  if(readLidar(ld, polarPoints)) {
-   dedistortTheta(polarPoints, robotTheta, oldRobotTheta);
+      for(int j = 0; j < NBCOMMANDS; j++) {
+       telemetryFrame.xy[j][0] = remoteFrame.xy[j][0];
+       telemetryFrame.xy[j][1] = remoteFrame.xy[j][1];
+      }
+      telemetryFrame.z = remoteFrame.z;
+      telemetryFrame.switchs = remoteFrame.switchs;
 
-   robotPoints.clear();
-   lidarToRobot(polarPoints, robotPoints);
+      writeModem(td, telemetryFrame);
+     }
+    } break;
+
+    case EVENTCAPTURE:
+    case EVENTFRAME:
+     if(captureEnabled) {
+      if(!retrieveFrame(grabber, image)) {
+       if(grabber.failed) {                                  // Continue sans caméra comme si elle était absente au démarrage
+        stopGrabber(grabber);
+        capture.release();
+        captureEnabled = false;
+        timer = createTimer(fps);
+        addToLoop(epfd, timer, EVENTFRAME);
+       }
+       break;
+      }
+     } else {
+      readEvent(timer);
+      createImage(image, width, height, yuv);
 
-   //dedistortLinear(robotPoints, robotPoint, oldRobotPoint, robotTheta);
-   //polarPoints.clear();
-   //robotToLidar(robotPoints, polarPoints);
+      lock_guard<mutex> lock(replayMutex);
+      if(replayImage)
+       memcpy(image.data, replayImage, size);
+     }
 
-   robotRawLines.clear();
-   extractRawLinesMike118(polarPoints, robotPoints, robotRawLines);
+     if(recordCamera) {
+      SessionCamera camera = {uint16_t(width), uint16_t(height)};
+      recordSession(SESSIONCAMERA, &camera, sizeof(camera), image.data, size);
+     }
 
-   robotLines.clear();
-   fitLines(robotRawLines, robotLines);
+     tickMeter.start();
 
-   if(!robotLines.empty()) {
-    sortLines(robotLines);
+     {
+      shared_ptr<const vector<Line>> snapshot;
+      {
+       lock_guard<mutex> lock(world.mutex);
+       snapshot = world.mapSnapshot;
+      }
+      if(snapshot != shownMap) {                             // Copiée hors du verrou, l'instantané est immuable
+       map = *snapshot;
+       shownMap = snapshot;
+      }
+     }
 
-    for(int i = 0; i < AXES; i++)
-     robotLinesAxes[i].clear();
-    splitAxes(robotLines, robotLinesAxes);
-    localization(robotLinesAxes, map, confidences, robotPoint, robotTheta);
-
-    mapPoints.clear();
-    robotToMap(robotPoints, mapPoints, robotPoint, robotTheta);
-
-    mapLines.clear();
-    robotToMap(robotLines, mapLines, robotPoint, robotTheta);
-
-    if(mappingEnabled) {
-     mapping(mapLines, map);
-     mapCleaner(polarPoints, map, robotPoint, robotTheta);
-     mapDeduplicateAverage(map);
-     mapDeduplicateErase(map);
-     mapIntersects(map);
-     mapFiltersDecay(map);
-    }
+     {
+      lock_guard<mutex> lock(world.mutex);                   // Seulement le temps de copier les entrées de l'affichage
+
+      if(world.scan && world.scan->sequence != renderedScan) {
+       const ScanSnapshot &scan = *world.scan;
+       renderedScan = scan.sequence;
+       robotPoints = scan.robotPoints;
+       if(scan.lines) {
+        for(int i = 0; i < AXES; i++)
+         robotLinesAxes[i] = scan.robotLinesAxes[i];
+        mapPoints = scan.mapPoints;
+        mapLines = scan.mapLines;
+       }
+      }
 
-    if(graphingEnabled)
-     graphing(polarPoints, mapPoints, nodes, links, paths, dists, targetPoint, targetNode, robotPoint, robotTheta);
-   }
+      if(world.graphVersion != graphVersion) {               // Le graphe n'est recopié que s'il a changé
+       graph = world.graph;
+       paths = world.paths;
+       dists = world.dists;
+       graphVersion = world.graphVersion;
+      }
+      robotPoint = world.robotPoint;
+      robotTheta = world.robotTheta;
+      oldRobotTheta = world.oldRobotTheta;
+      mappingEnabled = world.mappingEnabled;
+      graphingEnabled = world.graphingEnabled;
+      running = world.running;
+      targetPoint = world.targetPoint;
+      targetNode = world.targetNode;
+      closestRobot = world.closestRobot;
+      for(int i = 0; i < AXES; i++)
+       confidences[i] = world.confidences[i];
+     }
 
-   if(!nodes.empty())
-    closestRobot = closestPoint(nodes, robotPoint);
-  }
+     int mapSize = map.size();                               // Détection des modifications faites par l'interface
+     Point shownRobotPoint = robotPoint;
+     uint16_t shownRobotTheta = robotTheta;
+     bool oldMappingEnabled = mappingEnabled;
+     bool oldGraphingEnabled = graphingEnabled;
+     bool oldRunning = running;
+     Point oldTargetPoint = targetPoint;
+     int oldTargetNode = targetNode;
+     int oldClosestRobot = closestRobot;
+
+     ui(image, robotPoints, robotLinesAxes, mapLines, map, mapPoints,
+        graph, paths, dists, graphEdits, wayPoints, targetPoint,
+        targetNode, closestRobot, robotPoint, oldRobotPoint, robotTheta, oldRobotTheta,
+        mappingEnabled, graphingEnabled, running, patrolling, select, mapDiv, confidences, time);
+
+     patrol(graph, paths, dists, wayPoints, targetPoint, targetNode, robotPoint, patrolling);
+
+     {
+      lock_guard<mutex> lock(world.mutex);                   // Seules les éditions de l'interface sont reportées
+
+      if(map.size() != mapSize) {                            // Publiée tout de suite et appliquée par l'étage de cartographie
+       shownMap = make_shared<const vector<Line>>(map);
+       world.mapSnapshot = shownMap;
+       pushMapEdit({NULL, shownMap});
+      }
+      if(graphEdits.empty() && targetNode != oldTargetNode)  // Cible choisie par l'opérateur ou par la patrouille
+       graphEdits.push_back({GRAPHEDITTARGET, Point(0, 0), targetPoint});
+      if(!graphEdits.empty()) {
+       if(world.graphVersion == graphVersion) {              // Aucun étage n'a modifié le graphe depuis la copie
+        world.graph = graph;
+        world.paths = paths;
+        world.dists = dists;
+        world.targetNode = targetNode;
+       } else {                                              // Rejouées sur le graphe courant pour garder les modifications des étages
+        for(const GraphEdit &edit : graphEdits)
+         applyGraphEdit(world.graph, world.paths, world.dists, world.targetNode, edit);
+        if(!world.graph.nodes.empty())
+         world.closestRobot = closestPoint(world.graph.nodes, world.robotPoint);
+        graph = world.graph;
+        paths = world.paths;
+        dists = world.dists;
+        targetNode = world.targetNode;
+        closestRobot = world.closestRobot;
+       }
+       graphEdits.clear();
+       graphVersion = ++world.graphVersion;
+      }
+      if(graphingEnabled != oldGraphingEnabled) {
+       world.graphingEnabled = graphingEnabled;
+       world.graphVersion++;
+      }
+      if(robotPoint != shownRobotPoint || robotTheta != shownRobotTheta) { // Remise à zéro de la position
+       world.robotPoint = robotPoint;
+       world.robotTheta = robotTheta;
+       world.oldRobotTheta = oldRobotTheta;
+      }
+      if(mappingEnabled != oldMappingEnabled)
+       world.mappingEnabled = mappingEnabled;
+      if(running != oldRunning)
+       world.running = running;
+      if(targetPoint != oldTargetPoint)
+       world.targetPoint = targetPoint;
+      if(closestRobot != oldClosestRobot)
+       world.closestRobot = closestRobot;
+     }
 
-  ui(image, robotPoints, robotLinesAxes, mapLines, map, mapPoints,
-     nodes, links, paths, dists, wayPoints, targetPoint,
-     targetNode, closestRobot, robotPoint, oldRobotPoint, robotTheta, oldRobotTheta,
-     mappingEnabled, graphingEnabled, running, patrolling, select, mapDiv, confidences, time);
+     if(!writeFrame(output, image.data))
+      run = false;
+     if(captureEnabled)
+      releaseFrame(grabber);
 
-  patrol(nodes, links, paths, dists, wayPoints, targetPoint, targetNode, robotPoint, patrolling);
+     tickMeter.stop();                                      // Temps de l'image
+     time = tickMeter.getTimeMilli();
+     tickMeter.reset();
 
-  autopilot(mapPoints, nodes, links, paths, dists,
-            targetPoint, targetNode, closestRobot, robotPoint, robotTheta, running);
+     if(time > 1000 / fps)
+      fprintf(stderr, "Timeout error %d ms\n", time);
+     break;
 
-  if(updated) {
-   for(int i = 0; i < NBCOMMANDS; i++) {
-    telemetryFrame.xy[i][0] = remoteFrame.xy[i][0];
-    telemetryFrame.xy[i][1] = remoteFrame.xy[i][1];
    }
-   telemetryFrame.z = remoteFrame.z;
-   telemetryFrame.switchs = remoteFrame.switchs;
-
-   writeModem(fd, telemetryFrame);
   }
-
-  fwrite(image.data, size, 1, actualStdout);
-
-  tickMeter.stop();
-  time = tickMeter.getTimeMilli();
-  tickMeter.reset();
-
-  if(time > 1000 / fps)
-   fprintf(stderr, "Timeout error %d ms\n", time);
  }
 
  if(captureEnabled) {
   fprintf(stderr, "Stopping capture\n");
+  stopGrabber(grabber);
   capture.release();
  }
 
  fprintf(stderr, "Stopping lidar\n");
- stopLidar(ld);
+ if(replayFast)
+  writeEvent(replayEvent);
+ lidarThr.join();
+
+ fprintf(stderr, "Stopping pipeline stages\n");
+ writeEvent(lidarEvent);
+ world.changed.notify_all();
+ localizationThr.join();
+ mappingThr.join();
+ planningThr.join();
+ controlThr.join();
+
+ closeRecorder();
+ closeOutput(output);
 
  fprintf(stderr, "Writing map file\n");
- writeMapFile(map, nodes, links, wayPoints, robotPoint, robotTheta, mappingEnabled, graphingEnabled, running, patrolling, select, mapDiv);
+ map = *world.mapSnapshot;
+ writeMapFile(map, world.graph, wayPoints, world.robotPoint, world.robotTheta,
+              world.mappingEnabled, world.graphingEnabled, world.running, patrolling, select, mapDiv);
 
  fprintf(stderr, "Stopping\n");
  return 0;
@@ -27,14 +27,38 @@
 #define MAPDIVMAX 1000
 #define HIST 500
 
+#define STAGETIMEOUT 100 // Milliseconds
+#define MAPEDITSMAX 10                                       // Scans en attente au-delà desquels l'entretien abandonne les plus anciens
+#define MAPSNAPSHOTPERIOD 200 // Milliseconds
+#define MAPCOMPACTMIN 1000                                   // Emplacements périmés tolérés avant compactage, ou autant que de lignes
+#define EXTRACTORSTATSPERIOD 10 // Seconds, comment to disable the statistics
+#define LOCALIZATIONSTATSPERIOD 10 // Seconds, comment to disable the statistics
+#define MAPCLEANERSTATSPERIOD 10 // Seconds, comment to disable the statistics
+#define CONTROLRATE 100 // Hz
+#define CONTROLREFERENCERATE FPS                             // Fréquence pour laquelle les gains et diviseurs ont été réglés
+
+#define BENCHMARKNBPOINTS 450                                // Scan typique d'un LD06
+#define BENCHMARKDISTANCEMAX 12000
+#define BENCHMARKNBLINES 20
+#define BENCHMARKMAPSIDE 40000                               // Les carrés des distances entières débordent au-delà de 46 m
+#define BENCHMARKSETTLEPASSES 4
+#define BENCHMARKFIELDSAMPLES 10000
+
 #define AXES 2
 #define LARGEDISTTOLERANCE 300
 #define LARGEANGULARTOLERANCE (30.0 * M_PI / 180.0)
 #define SMALLDISTTOLERANCE 40
 #define SMALLANGULARTOLERANCE (2.0 * M_PI / 180.0)
+#define RESIDUALWEIGHT 10                                    // Résidu en millimètres qui divise par deux le poids d'une ligne
+#define FIELDHUBER 50                                        // Distance en millimètres au-delà de laquelle un point perd de son poids
+#define FIELDMATCHEDMIN 20                                   // Points dans le champ en dessous desquels la pose n'est pas corrigée
+#define FIELDDAMPING 1.0                                     // Poids d'un point fictif à 1 m qui retient la pose
+#define FIELDSTEPMIN 1.0 // Millimeters
+#define FIELDANGULARSTEPMIN (0.05 * M_PI / 180.0)
 #define INTERSECTMAX 10000
 #define MAPCLEANERDISTPERCENT 50
 #define MAPCLEANERANGULARTOLERANCE (15.0 * M_PI / 180.0)
+#define MAPCLEANERRAYMARGIN 1.0                              // Demi-épaisseur en millimètres des rayons dans l'index
 
 #define VALIDATIONFILTERKILL -5
 #define VALIDATIONFILTERSTART 0
@@ -46,6 +70,9 @@
 #define ITERATIONCONFIDENCE 1
 #define RECOVERYCONFIDENCE 10
 #define RECOVERYDISTTOLERANCE 1000
+#define RELOCSCANS 30                                        // Scans consécutifs à faible confiance avant une relocalisation globale
+#define RELOCSCOREMIN 50                                     // Pourcentage du score maximal
+#define RELOCBUDGET 500 // Milliseconds
 
 #define GOTOPOINTDISTTOLERANCE 150
 #define GOTOPOINTANGLEREVERSEGEAR 150
@@ -89,6 +116,35 @@ enum {
  SELECTLIDARONLY
 };
 
+enum {
+ EXTRACTORMIKE118,
+ EXTRACTORSTREAMING,
+ NBEXTRACTORS
+};
+
+const char *EXTRACTORS[] = {"mike118", "streaming"};
+
+enum {
+ ENGINELINES,
+ ENGINEFIELD,
+ NBENGINES
+};
+
+const char *ENGINES[] = {"lines", "field"};
+
+enum {
+ LINECLEAN,
+ LINEDIRTY,                                                  // À entretenir pendant ce scan
+ LINECARRIED                                                 // Modifiée par l'entretien, revue au scan suivant
+};
+
+enum {
+ GRAPHEDITTARGET,
+ GRAPHEDITADD,
+ GRAPHEDITDELETE,
+ GRAPHEDITCLEAR
+};
+
 const std::vector<cv::Point> robotIcon = {
  cv::Point(-30, -40),
  cv::Point{30, -40},
@@ -108,13 +164,115 @@ typedef struct Line {
  int validation;
  int shrinka;
  int shrinkb;
+ int residual;                                               // Résidu de l'ajustement en millimètres, 0 pour la carte
+ bool settled;                                               // Entretenue depuis sa dernière modification, faux pour une ligne lue ou créée
 } Line;
 
+typedef struct LineMap {                                     // Carte en cours d'entretien, les emplacements restent stables jusqu'au compactage
+ std::vector<Line> lines;
+ std::vector<bool> erased;
+ std::vector<uint8_t> dirty;
+ std::vector<int> touched;                                   // Emplacements hors de LINECLEAN, revus à la fin de chaque scan
+ bool maintaining;                                           // Les modifications attendent alors le scan suivant
+ int maxLength;                                              // Majorant de la longueur des lignes, en millimètres
+ int stale;                                                  // Emplacements effacés et positions périmées de l'index
+ MapIndex index;                                             // Toutes les positions prises depuis le dernier compactage
+} LineMap;
+
 typedef std::pair<int, int> Pair;
 
+typedef struct LineFit {                                     // Moments d'un segment en cours de croissance
+ cv::Point origin;
+ cv::Point first;
+ cv::Point last;
+ int n;
+ double sx;
+ double sy;
+ double sxx;
+ double syy;
+ double sxy;
+} LineFit;
+
+typedef struct ScanSnapshot {                                // Résultat de la localisation, immuable une fois publié
+ uint32_t sequence;
+ std::vector<PolarPoint> polarPoints;
+ std::vector<cv::Point> robotPoints;
+ std::vector<Line> robotLinesAxes[AXES];
+ std::vector<cv::Point> mapPoints;
+ std::vector<Line> mapLines;
+ cv::Point robotPoint;
+ uint16_t robotTheta;
+ bool lines;
+} ScanSnapshot;
+
+typedef struct MapEdit {                                     // Modification en attente, appliquée dans l'ordre par l'étage de cartographie
+ std::shared_ptr<const ScanSnapshot> scan;                   // Scan à intégrer
+ std::shared_ptr<const std::vector<Line>> map;               // Ou carte modifiée par l'interface, qui remplace la carte entretenue
+} MapEdit;
+
+typedef struct GraphEdit {                                   // Édition de l'opérateur, rejouée sur le graphe courant s'il a changé entre-temps
+ int type;
+ cv::Point node;                                             // Nœud ajouté ou supprimé, repéré par sa position
+ cv::Point targetPoint;
+} GraphEdit;
+
+typedef struct ExtractorStats {
+ uint64_t start;
+ uint64_t cpuTime;
+ int scans;
+ int lines;
+} ExtractorStats;
+
+typedef struct LocalizationStats {
+ uint64_t start;
+ uint64_t cpuTime;
+ int scans;
+ int confidence;
+} LocalizationStats;
+
+typedef struct MapCleanerStats {
+ uint64_t start;
+ uint64_t cpuTime;
+ uint64_t rays;
+ uint64_t tests;
+ uint64_t lines;
+ int scans;
+} MapCleanerStats;
+
+typedef struct World {                                       // État partagé entre les étages, protégé par mutex
+ std::mutex mutex;
+ std::condition_variable changed;
+ std::shared_ptr<const ScanSnapshot> scan;
+ std::shared_ptr<const std::vector<Line>> mapSnapshot;       // Seule forme partagée de la carte, remplacée et jamais modifiée
+ std::deque<MapEdit> mapEdits;
+ uint32_t graphVersion;                                      // Incrémenté à chaque modification par un étage ou par l'interface
+ uint32_t mapped;                                            // Dernier scan traité par chaque étage
+ uint32_t planned;
+ Graph graph;
+ std::vector<int> paths;
+ std::vector<int> dists;
+ cv::Point targetPoint;
+ int targetNode;
+ int closestRobot;
+ cv::Point robotPoint;
+ uint16_t robotTheta;
+ uint16_t oldRobotTheta;
+ bool mappingEnabled;
+ bool graphingEnabled;
+ bool running;
+ int confidences[AXES];
+} World;
+
 int width;
 int height;
 int fps;
+int controlRate = CONTROLRATE;
+int extractor = EXTRACTORMIKE118;
+ExtractorStats extractorStats;
+int engine = ENGINELINES;
+LocalizationStats localizationStats;
+MapCleanerStats mapCleanerStats;
+bool yuv = false;
 
 volatile bool run = true;
 
@@ -124,6 +282,18 @@ TelemetryFrame telemetryFrame;
 RTIMU_DATA imuData;
 RTIMU *imu;
 volatile int imuThreadStatus = STATUSWAITING;
-uint16_t robotThetaCorrector = 0;
+std::atomic<uint16_t> robotThetaCorrector(0);
+
+LidarScans lidarScans;
+int lidarEvent;
+
+World world;
+
+bool replayFast = false;
+int replayModem[2];
+int replayLidar[2];
+int replayEvent;
+std::mutex replayMutex;
+const uint8_t *replayImage = NULL;
 
 cv::Scalar hueToBgr[180];
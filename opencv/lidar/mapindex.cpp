@@ -0,0 +1,107 @@
+#include <algorithm>
+#include <cmath>
+#include "mapindex.hpp"
+
+using namespace std;
+using namespace cv;
+
+static int cellCoord(int x) {
+ if(x >= 0)
+  return x / MAPINDEXCELL;
+ return (x + 1) / MAPINDEXCELL - 1;                          // Arrondi vers moins l'infini
+}
+
+static uint64_t cellKey(int cx, int cy) {
+ return uint64_t(uint32_t(cx)) << 32 | uint32_t(cy);
+}
+
+void clearIndex(MapIndex &index) {
+ index.cells.clear();
+ index.marks.clear();
+ index.mark = 0;
+}
+
+void insertIndex(MapIndex &index, int id, Point a, Point b) {
+ int cxMin = cellCoord(min(a.x, b.x));
+ int cxMax = cellCoord(max(a.x, b.x));
+ int cyMin = cellCoord(min(a.y, b.y));
+ int cyMax = cellCoord(max(a.y, b.y));
+
+ for(int cx = cxMin; cx <= cxMax; cx++) {
+  for(int cy = cyMin; cy <= cyMax; cy++) {
+   vector<int> &cell = index.cells[cellKey(cx, cy)];
+   if(cell.empty() || cell.back() != id)                     // Les autres doublons sont filtrés à la requête
+    cell.push_back(id);
+  }
+ }
+
+ if(id >= index.marks.size())
+  index.marks.resize(id + 1, 0);
+}
+
+void startQuery(MapIndex &index, vector<int> &ids) {
+ ids.clear();
+ index.mark++;
+ if(!index.mark) {                                           // Rebouclage du compteur
+  fill(index.marks.begin(), index.marks.end(), 0);
+  index.mark = 1;
+ }
+}
+
+void queryIndex(MapIndex &index, Point low, Point high, vector<int> &ids) {
+ int cxMin = cellCoord(low.x);
+ int cxMax = cellCoord(high.x);
+ int cyMin = cellCoord(low.y);
+ int cyMax = cellCoord(high.y);
+
+ for(int cx = cxMin; cx <= cxMax; cx++) {
+  for(int cy = cyMin; cy <= cyMax; cy++) {
+   auto it = index.cells.find(cellKey(cx, cy));
+   if(it == index.cells.end())
+    continue;
+
+   for(int id : it->second) {
+    if(index.marks[id] != index.mark) {
+     index.marks[id] = index.mark;
+     ids.push_back(id);
+    }
+   }
+  }
+ }
+
+ sort(ids.begin(), ids.end());                               // Même ordre de parcours que la carte triée
+}
+
+void queryRay(MapIndex &index, Point2d a, Point2d b, vector<int> &ids) {
+ int cx = floor(a.x / MAPINDEXCELL);                         // Parcours DDA des mailles traversées, sans tri
+ int cy = floor(a.y / MAPINDEXCELL);
+ int nbSteps = abs(int(floor(b.x / MAPINDEXCELL)) - cx) + abs(int(floor(b.y / MAPINDEXCELL)) - cy);
+ double dx = b.x - a.x;
+ double dy = b.y - a.y;
+ int stepX = dx > 0.0 ? 1 : -1;
+ int stepY = dy > 0.0 ? 1 : -1;
+ double tMaxX = dx != 0.0 ? ((cx + (dx > 0.0)) * double(MAPINDEXCELL) - a.x) / dx : INFINITY;
+ double tMaxY = dy != 0.0 ? ((cy + (dy > 0.0)) * double(MAPINDEXCELL) - a.y) / dy : INFINITY;
+ double tDeltaX = dx != 0.0 ? MAPINDEXCELL / fabs(dx) : INFINITY;
+ double tDeltaY = dy != 0.0 ? MAPINDEXCELL / fabs(dy) : INFINITY;
+
+ for(int i = 0; i <= nbSteps; i++) {
+  auto it = index.cells.find(cellKey(cx, cy));
+  if(it != index.cells.end()) {
+   for(int id : it->second) {
+    if(index.marks[id] != index.mark) {
+     index.marks[id] = index.mark;
+     ids.push_back(id);
+    }
+   }
+  }
+
+  if(tMaxX < tMaxY) {
+   cx += stepX;
+   tMaxX += tDeltaX;
+  } else {
+   cy += stepY;
+   tMaxY += tDeltaY;
+  }
+ }
+}
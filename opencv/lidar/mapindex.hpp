@@ -0,0 +1,18 @@
+#include <stdint.h>
+#include <vector>
+#include <unordered_map>
+#include <opencv2/opencv.hpp>
+
+#define MAPINDEXCELL 1000 // Millimeters
+
+typedef struct MapIndex {                                    // Grille uniforme creuse, chaque cellule liste les segments dont la boîte la recouvre
+ std::unordered_map<uint64_t, std::vector<int>> cells;
+ std::vector<uint32_t> marks;                                // Déduplication des résultats d'une requête
+ uint32_t mark;
+} MapIndex;
+
+void clearIndex(MapIndex &index);
+void insertIndex(MapIndex &index, int id, cv::Point a, cv::Point b);
+void startQuery(MapIndex &index, std::vector<int> &ids);
+void queryIndex(MapIndex &index, cv::Point low, cv::Point high, std::vector<int> &ids);
+void queryRay(MapIndex &index, cv::Point2d a, cv::Point2d b, std::vector<int> &ids);
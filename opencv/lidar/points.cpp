@@ -0,0 +1,154 @@
+#include "lidars.hpp"
+#include "sin16.hpp"
+#include "points.hpp"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define ONE16SHIFT 15
+
+using namespace std;
+using namespace cv;
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+static inline int32x4_t divOne16(int32x4_t v) {              // Division par ONE16 tronquée vers zéro comme en C
+ int32x4_t bias = vandq_s32(vshrq_n_s32(v, 31), vdupq_n_s32(ONE16 - 1));
+ return vshrq_n_s32(vaddq_s32(v, bias), ONE16SHIFT);
+}
+#elif defined(__SSE2__)
+static inline __m128i divOne16(__m128i v) {
+ __m128i bias = _mm_and_si128(_mm_srai_epi32(v, 31), _mm_set1_epi32(ONE16 - 1));
+ return _mm_srai_epi32(_mm_add_epi32(v, bias), ONE16SHIFT);
+}
+
+static inline __m128i mulOne16(__m128i a, __m128i b, bool high) {
+ __m128i lo = _mm_mullo_epi16(a, b);
+ __m128i hi = _mm_mulhi_epi16(a, b);
+ return divOne16(high ? _mm_unpackhi_epi16(lo, hi) : _mm_unpacklo_epi16(lo, hi));
+}
+#endif
+
+void loadScan(const vector<PolarPoint> &polarPoints, ScanPoints &scan) {
+ scan.size = polarPoints.size();
+ int padded = (scan.size + SCANPOINTSBLOCK - 1) / SCANPOINTSBLOCK * SCANPOINTSBLOCK;
+
+ scan.distances.assign(padded, 0);
+ scan.thetas.assign(padded, 0);
+ scan.sins.resize(padded);
+ scan.coss.resize(padded);
+ scan.robotX.resize(padded);
+ scan.robotY.resize(padded);
+ scan.mapX.resize(padded);
+ scan.mapY.resize(padded);
+
+ for(int i = 0; i < scan.size; i++) {
+  scan.distances[i] = min(polarPoints[i].distance, SCANDISTANCEMAX);
+  scan.thetas[i] = polarPoints[i].theta;
+ }
+
+ for(int i = 0; i < padded; i++) {                           // Pas de gather en NEON ni SSE2, la table reste scalaire
+  scan.sins[i] = sinTable16[scan.thetas[i]] - ONE16;
+  scan.coss[i] = sinTable16[uint16_t(HALFPI16 - scan.thetas[i])] - ONE16;
+ }
+}
+
+void polarToRobot(ScanPoints &scan) {
+ int padded = scan.distances.size();
+ const int16_t *distances = scan.distances.data();
+ const int16_t *sins = scan.sins.data();
+ const int16_t *coss = scan.coss.data();
+ int16_t *robotX = scan.robotX.data();
+ int16_t *robotY = scan.robotY.data();
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+ for(int i = 0; i < padded; i += 4) {
+  int16x4_t distance = vld1_s16(distances + i);
+  vst1_s16(robotX + i, vmovn_s32(divOne16(vmull_s16(distance, vld1_s16(sins + i)))));
+  vst1_s16(robotY + i, vmovn_s32(divOne16(vmull_s16(distance, vld1_s16(coss + i)))));
+ }
+#elif defined(__SSE2__)
+ for(int i = 0; i < padded; i += 8) {
+  __m128i distance = _mm_loadu_si128((const __m128i *) (distances + i));
+  __m128i sinValues = _mm_loadu_si128((const __m128i *) (sins + i));
+  __m128i cosValues = _mm_loadu_si128((const __m128i *) (coss + i));
+  __m128i x = _mm_packs_epi32(mulOne16(distance, sinValues, false), mulOne16(distance, sinValues, true));
+  __m128i y = _mm_packs_epi32(mulOne16(distance, cosValues, false), mulOne16(distance, cosValues, true));
+  _mm_storeu_si128((__m128i *) (robotX + i), x);
+  _mm_storeu_si128((__m128i *) (robotY + i), y);
+ }
+#else
+ for(int i = 0; i < padded; i++) {
+  robotX[i] = distances[i] * sins[i] / ONE16;
+  robotY[i] = distances[i] * coss[i] / ONE16;
+ }
+#endif
+}
+
+void scanToMap(ScanPoints &scan, Point robotPoint, uint16_t robotTheta) {
+ int padded = scan.robotX.size();
+ const int16_t *robotX = scan.robotX.data();
+ const int16_t *robotY = scan.robotY.data();
+ int32_t *mapX = scan.mapX.data();
+ int32_t *mapY = scan.mapY.data();
+ int16_t sinTheta = sin16(robotTheta);
+ int16_t cosTheta = cos16(robotTheta);
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+ int32x4_t offsetX = vdupq_n_s32(robotPoint.x);
+ int32x4_t offsetY = vdupq_n_s32(robotPoint.y);
+
+ for(int i = 0; i < padded; i += 4) {
+  int16x4_t x = vld1_s16(robotX + i);
+  int16x4_t y = vld1_s16(robotY + i);
+  int32x4_t rotatedX = vmlsl_n_s16(vmull_n_s16(x, cosTheta), y, sinTheta);
+  int32x4_t rotatedY = vmlal_n_s16(vmull_n_s16(x, sinTheta), y, cosTheta);
+  vst1q_s32(mapX + i, vaddq_s32(divOne16(rotatedX), offsetX));
+  vst1q_s32(mapY + i, vaddq_s32(divOne16(rotatedY), offsetY));
+ }
+#elif defined(__SSE2__)
+ __m128i cosSin = _mm_set1_epi32(uint16_t(cosTheta) | uint32_t(uint16_t(sinTheta)) << 16);
+ __m128i sinCos = _mm_set1_epi32(uint16_t(sinTheta) | uint32_t(uint16_t(cosTheta)) << 16);
+ __m128i offsetX = _mm_set1_epi32(robotPoint.x);
+ __m128i offsetY = _mm_set1_epi32(robotPoint.y);
+ __m128i zero = _mm_setzero_si128();
+
+ for(int i = 0; i < padded; i += 8) {
+  __m128i x = _mm_loadu_si128((const __m128i *) (robotX + i));
+  __m128i y = _mm_loadu_si128((const __m128i *) (robotY + i));
+  __m128i minusY = _mm_sub_epi16(zero, y);                   // |y| <= SCANDISTANCEMAX, pas de débordement
+  __m128i xMinusY[] = {_mm_unpacklo_epi16(x, minusY), _mm_unpackhi_epi16(x, minusY)};
+  __m128i xy[] = {_mm_unpacklo_epi16(x, y), _mm_unpackhi_epi16(x, y)};
+
+  for(int j = 0; j < 2; j++) {
+   __m128i rotatedX = _mm_madd_epi16(xMinusY[j], cosSin);    // x * cos - y * sin
+   __m128i rotatedY = _mm_madd_epi16(xy[j], sinCos);         // x * sin + y * cos
+   _mm_storeu_si128((__m128i *) (mapX + i + j * 4), _mm_add_epi32(divOne16(rotatedX), offsetX));
+   _mm_storeu_si128((__m128i *) (mapY + i + j * 4), _mm_add_epi32(divOne16(rotatedY), offsetY));
+  }
+ }
+#else
+ for(int i = 0; i < padded; i++) {
+  mapX[i] = (robotX[i] * cosTheta - robotY[i] * sinTheta) / ONE16 + robotPoint.x;
+  mapY[i] = (robotX[i] * sinTheta + robotY[i] * cosTheta) / ONE16 + robotPoint.y;
+ }
+#endif
+}
+
+void storePoints(const int16_t *x, const int16_t *y, int size, vector<Point> &points) {
+ int offset = points.size();
+ points.resize(offset + size);
+
+ for(int i = 0; i < size; i++)
+  points[offset + i] = Point(x[i], y[i]);
+}
+
+void storePoints(const int32_t *x, const int32_t *y, int size, vector<Point> &points) {
+ int offset = points.size();
+ points.resize(offset + size);
+
+ for(int i = 0; i < size; i++)
+  points[offset + i] = Point(x[i], y[i]);
+}
@@ -0,0 +1,32 @@
+#include <stdint.h>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+#define SCANPOINTSBLOCK 8                                    // Points traités par itération SIMD
+#define SCANDISTANCEMAX 32767                                // Les distances sont stockées sur 16 bits signés
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define POINTSKERNEL "NEON"
+#elif defined(__SSE2__)
+#define POINTSKERNEL "SSE2"
+#else
+#define POINTSKERNEL "scalar"
+#endif
+
+typedef struct ScanPoints {                                  // Scan en structure de tableaux, complété à un multiple de SCANPOINTSBLOCK
+ int size;
+ std::vector<int16_t> distances;
+ std::vector<uint16_t> thetas;
+ std::vector<int16_t> sins;
+ std::vector<int16_t> coss;
+ std::vector<int16_t> robotX;
+ std::vector<int16_t> robotY;
+ std::vector<int32_t> mapX;
+ std::vector<int32_t> mapY;
+} ScanPoints;
+
+void loadScan(const std::vector<PolarPoint> &polarPoints, ScanPoints &scan);
+void polarToRobot(ScanPoints &scan);
+void scanToMap(ScanPoints &scan, cv::Point robotPoint, uint16_t robotTheta);
+void storePoints(const int16_t *x, const int16_t *y, int size, std::vector<cv::Point> &points);
+void storePoints(const int32_t *x, const int32_t *y, int size, std::vector<cv::Point> &points);
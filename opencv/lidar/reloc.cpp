@@ -0,0 +1,172 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include "field.hpp"
+#include "reloc.hpp"
+
+using namespace std;
+using namespace cv;
+
+typedef struct Candidate {
+ int x;
+ int y;
+ int angle;
+ int score;
+} Candidate;
+
+static int floorDiv(int x, int d) {
+ if(x >= 0)
+  return x / d;
+ return (x + 1) / d - 1;                                     // Arrondi vers moins l'infini
+}
+
+static int levelValue(const RelocGrid &grid, int level, int x, int y) {
+ int pad = (1 << level) - 1;                                 // Les fenêtres qui débordent à gauche et en bas sont conservées
+ x += pad;
+ y += pad;
+ int width = grid.width + pad;
+ if(x < 0 || y < 0 || x >= width || y >= grid.height + pad)
+  return 0;
+ return grid.levels[level][y * width + x];
+}
+
+void buildRelocGrid(RelocGrid &grid, const DistanceField &field, Point low, Point high) {
+ grid.origin = Point(floorDiv(low.x, RELOCRESOLUTION) * RELOCRESOLUTION, floorDiv(low.y, RELOCRESOLUTION) * RELOCRESOLUTION);
+ grid.width = (high.x - grid.origin.x) / RELOCRESOLUTION + 1;
+ grid.height = (high.y - grid.origin.y) / RELOCRESOLUTION + 1;
+ grid.levels.assign(RELOCDEPTH + 1, vector<uint8_t>());
+
+ vector<uint8_t> &base = grid.levels[0];
+ base.resize(grid.width * grid.height);
+ for(int y = 0; y < grid.height; y++) {
+  for(int x = 0; x < grid.width; x++) {
+   double dist;
+   double gradX;
+   double gradY;
+   sampleField(field, grid.origin.x + (x + 0.5) * RELOCRESOLUTION, grid.origin.y + (y + 0.5) * RELOCRESOLUTION, dist, gradX, gradY);
+   base[y * grid.width + x] = max(RELOCDIST - dist, 0.0) * 255 / RELOCDIST;
+  }
+ }
+
+ for(int level = 1; level <= RELOCDEPTH; level++) {          // Fenêtre doublée à partir du niveau précédent
+  int half = 1 << (level - 1);
+  int pad = (1 << level) - 1;
+  int width = grid.width + pad;
+  int height = grid.height + pad;
+  vector<uint8_t> &values = grid.levels[level];
+  values.resize(width * height);
+
+  for(int y = 0; y < height; y++) {
+   for(int x = 0; x < width; x++) {
+    int gx = x - pad;
+    int gy = y - pad;
+    values[y * width + x] = max(max(levelValue(grid, level - 1, gx, gy), levelValue(grid, level - 1, gx + half, gy)),
+                                max(levelValue(grid, level - 1, gx, gy + half), levelValue(grid, level - 1, gx + half, gy + half)));
+   }
+  }
+ }
+}
+
+static int scoreCandidate(const RelocGrid &grid, int level, const vector<Point> &cells, int x, int y) {
+ int score = 0;
+ for(int i = 0; i < cells.size(); i++)
+  score += levelValue(grid, level, cells[i].x + x, cells[i].y + y);
+ return score;
+}
+
+bool relocalize(const RelocGrid &grid, const vector<Point> &robotPoints, int scoreMin, int budget,
+                Point &robotPoint, double &robotTheta, int &score) {
+ vector<Point> points;
+ int nbPoints = 0;
+ for(int i = 0; i < robotPoints.size(); i++) {
+  if(robotPoints[i] != Point(0, 0))
+   nbPoints++;
+ }
+ if(!nbPoints)
+  return false;
+
+ int rangeMax = 0;
+ for(int i = 0, n = 0; i < robotPoints.size(); i++) {        // Sous-échantillonnage régulier
+  if(robotPoints[i] == Point(0, 0))
+   continue;
+  if(n++ * RELOCNBPOINTS / nbPoints == points.size()) {
+   points.push_back(robotPoints[i]);
+   rangeMax = max(rangeMax, int(sqrt(double(robotPoints[i].x) * robotPoints[i].x + double(robotPoints[i].y) * robotPoints[i].y)));
+  }
+ }
+
+ double angularStep = acos(1.0 - 0.5 * RELOCRESOLUTION * RELOCRESOLUTION / max(double(rangeMax) * rangeMax, double(RELOCRESOLUTION) * RELOCRESOLUTION));
+ int nbAngles = ceil(2.0 * M_PI / angularStep);
+ angularStep = 2.0 * M_PI / nbAngles;
+
+ vector<vector<Point>> cells(nbAngles);                      // Mailles des points relatives au robot pour chaque angle
+ for(int i = 0; i < nbAngles; i++) {
+  double sinTheta = sin(i * angularStep);
+  double cosTheta = cos(i * angularStep);
+  for(int j = 0; j < points.size(); j++) {
+   double x = points[j].x * cosTheta - points[j].y * sinTheta;
+   double y = points[j].x * sinTheta + points[j].y * cosTheta;
+   cells[i].push_back(Point(floor(x / RELOCRESOLUTION), floor(y / RELOCRESOLUTION)));
+  }
+ }
+
+ auto deadline = chrono::steady_clock::now() + chrono::milliseconds(budget);
+ int best = scoreMin * int(points.size()) * 255 / 100;
+ Candidate found = {0, 0, -1, 0};
+ bool timeout = false;
+
+ vector<vector<Candidate>> stack(RELOCDEPTH + 1);            // Recherche en profondeur, meilleurs enfants d'abord
+ int step = 1 << RELOCDEPTH;
+ for(int i = 0; i < nbAngles; i++) {
+  for(int y = 0; y < grid.height; y += step) {
+   for(int x = 0; x < grid.width; x += step)
+    stack[RELOCDEPTH].push_back({x, y, i, scoreCandidate(grid, RELOCDEPTH, cells[i], x, y)});
+  }
+ }
+ sort(stack[RELOCDEPTH].begin(), stack[RELOCDEPTH].end(), [](const Candidate &a, const Candidate &b) {
+  return a.score < b.score;
+ });
+
+ int level = RELOCDEPTH;
+ while(level <= RELOCDEPTH && !timeout) {
+  if(stack[level].empty() || stack[level].back().score <= best) {
+   stack[level].clear();                                     // Les candidats restants ne peuvent pas faire mieux
+   level++;
+   continue;
+  }
+
+  Candidate candidate = stack[level].back();
+  stack[level].pop_back();
+
+  if(!level) {
+   best = candidate.score;
+   found = candidate;
+   continue;
+  }
+
+  int half = 1 << (level - 1);
+  level--;
+  for(int dy = 0; dy <= half; dy += half) {
+   for(int dx = 0; dx <= half; dx += half) {
+    int x = candidate.x + dx;
+    int y = candidate.y + dy;
+    if(x < grid.width && y < grid.height)
+     stack[level].push_back({x, y, candidate.angle, scoreCandidate(grid, level, cells[candidate.angle], x, y)});
+   }
+  }
+  sort(stack[level].begin(), stack[level].end(), [](const Candidate &a, const Candidate &b) {
+   return a.score < b.score;
+  });
+
+  timeout = chrono::steady_clock::now() > deadline;
+ }
+
+ if(found.angle < 0)
+  return false;
+
+ robotPoint = grid.origin + Point(found.x * RELOCRESOLUTION, found.y * RELOCRESOLUTION);
+ robotTheta = found.angle * angularStep;
+ score = found.score * 100 / (int(points.size()) * 255);
+
+ return true;
+}
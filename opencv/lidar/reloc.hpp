@@ -0,0 +1,19 @@
+#include <stdint.h>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+#define RELOCRESOLUTION 100 // Millimeters
+#define RELOCDIST 200                                        // Distance au mur à laquelle un point ne rapporte plus rien
+#define RELOCDEPTH 7                                         // Niveaux de grilles, la plus grossière regroupe 2^RELOCDEPTH mailles
+#define RELOCNBPOINTS 150                                    // Points du scan conservés pour la recherche
+
+typedef struct RelocGrid {                                   // Grilles de score, le niveau k contient le maximum sur 2^k x 2^k mailles
+ cv::Point origin;
+ int width;
+ int height;
+ std::vector<std::vector<uint8_t>> levels;
+} RelocGrid;
+
+void buildRelocGrid(RelocGrid &grid, const DistanceField &field, cv::Point low, cv::Point high);
+bool relocalize(const RelocGrid &grid, const std::vector<cv::Point> &robotPoints, int scoreMin, int budget,
+                cv::Point &robotPoint, double &robotTheta, int &score);
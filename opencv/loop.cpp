@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include "loop.hpp"
+
+int createLoop() {
+ int epfd = epoll_create1(EPOLL_CLOEXEC);
+ if(epfd == -1)
+  fprintf(stderr, "Error creating event loop\n");
+
+ return epfd;
+}
+
+bool addToLoop(int epfd, int fd, int id) {
+ struct epoll_event event = {};
+ event.events = EPOLLIN;
+ event.data.u32 = id;
+
+ if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) == -1) {
+  fprintf(stderr, "Error adding the file descriptor %d to the event loop\n", fd);
+  return false;
+ }
+
+ return true;
+}
+
+int waitLoop(int epfd, int ids[], int timeout) {
+ struct epoll_event events[NBEVENTSMAX];
+
+ int n = epoll_wait(epfd, events, NBEVENTSMAX, timeout);
+ for(int i = 0; i < n; i++)
+  ids[i] = events[i].data.u32;
+
+ if(n < 0)                                                   // Interrompu par un signal
+  n = 0;
+
+ return n;
+}
+
+int createTimer(int fps) {
+ int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+ if(fd == -1) {
+  fprintf(stderr, "Error creating frame timer\n");
+  return -1;
+ }
+
+ uint64_t interval = 1000000000 / fps;
+ struct itimerspec period = {};
+ period.it_interval.tv_sec = interval / 1000000000;
+ period.it_interval.tv_nsec = interval % 1000000000;
+ period.it_value = period.it_interval;
+ timerfd_settime(fd, 0, &period, NULL);
+
+ return fd;
+}
+
+int createEvent(bool nonBlocking) {
+ int fd = eventfd(0, EFD_CLOEXEC | (nonBlocking ? EFD_NONBLOCK : 0));
+ if(fd == -1)
+  fprintf(stderr, "Error creating event\n");
+
+ return fd;
+}
+
+void writeEvent(int fd) {
+ uint64_t one = 1;
+ write(fd, &one, sizeof(one));
+}
+
+uint64_t readEvent(int fd) {
+ uint64_t count = 0;
+ read(fd, &count, sizeof(count));
+ return count;
+}
@@ -0,0 +1,19 @@
+#include <stdint.h>
+
+#define NBEVENTSMAX 8
+#define LOOPTIMEOUT 1000 // Milliseconds
+
+enum {
+ EVENTMODEM,
+ EVENTLIDAR,
+ EVENTFRAME,
+ EVENTCAPTURE
+};
+
+int createLoop();
+bool addToLoop(int epfd, int fd, int id);
+int waitLoop(int epfd, int ids[], int timeout);
+int createTimer(int fps);
+int createEvent(bool nonBlocking);
+void writeEvent(int fd);
+uint64_t readEvent(int fd);
@@ -59,6 +59,10 @@ do
  -lopencv_videoio \
  -lwiringPi \
  -lpthread \
+ -lrt \
+ -lavcodec \
+ -lavutil \
+ -lswscale \
  -lRTIMULib && \
  trace "Success to compile $cur and $sub to $bin" || \
  trace "Failed to compile $cur and $sub to $bin"
@@ -0,0 +1,127 @@
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "common.hpp"
+#include "output.hpp"
+#include "draw.hpp"
+
+ShmRing *mapRing(bool create, size_t size) {
+ int fd = shm_open(SHMNAME, create ? O_RDWR | O_CREAT : O_RDWR, 0600);
+ if(fd == -1)
+  return NULL;
+
+ if(create)
+  ftruncate(fd, size);
+ else {
+  ShmRing *header = (ShmRing *) mmap(NULL, sizeof(ShmRing), PROT_READ, MAP_SHARED, fd, 0);
+  if(header == MAP_FAILED) {
+   close(fd);
+   return NULL;
+  }
+  bool valid = header->magic == SHMMAGIC;
+  size = SHMDATAOFFSET + size_t(header->frameSize) * NBSHMSLOTS;
+  munmap(header, sizeof(ShmRing));
+  if(!valid) {                                               // Le producteur n'a pas fini d'initialiser l'anneau
+   close(fd);
+   return NULL;
+  }
+ }
+
+ void *ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+ close(fd);
+ if(ring == MAP_FAILED)
+  return NULL;
+
+ return (ShmRing *) ring;
+}
+
+uint8_t *ringFrame(ShmRing *ring, uint32_t sequence) {
+ return (uint8_t *) ring + SHMDATAOFFSET + size_t(sequence % NBSHMSLOTS) * ring->frameSize;
+}
+
+void wakeRing(ShmRing *ring) {
+ syscall(SYS_futex, &ring->sequence, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+bool waitRing(ShmRing *ring, uint32_t sequence, int timeout) {
+ struct timespec ts = {timeout / 1000, (timeout % 1000) * 1000000};
+
+ if(ring->sequence.load(std::memory_order_acquire) != sequence)
+  return true;
+
+ syscall(SYS_futex, &ring->sequence, FUTEX_WAIT, sequence, &ts, NULL, 0);
+ return ring->sequence.load(std::memory_order_acquire) != sequence;
+}
+
+bool openOutput(Output &output, int mode, FILE *pipe, const EncoderSettings &settings, int width, int height, int fps, bool yuv) {
+ int frameSize = imageSize(width, height, yuv);
+
+ output.mode = mode;
+ output.pipe = pipe;
+ output.ring = NULL;
+ output.frameSize = frameSize;
+
+ if(mode == OUTPUTH264)
+  return openEncoder(output.encoder, settings, width, height, fps, yuv);
+ else if(mode != OUTPUTSHM)
+  return true;
+
+ ShmRing *ring = mapRing(true, SHMDATAOFFSET + size_t(frameSize) * NBSHMSLOTS);
+ if(ring == NULL) {
+  fprintf(stderr, "Error opening shared memory %s\n", SHMNAME);
+  return false;
+ }
+
+ ring->magic = 0;
+ ring->frameSize = frameSize;
+ ring->width = width;
+ ring->height = height;
+ ring->fps = fps;
+ ring->yuv = yuv;
+ ring->sequence = 0;
+ for(int i = 0; i < NBSHMSLOTS; i++)
+  ring->slots[i].sequence = 0;
+ ring->magic.store(SHMMAGIC, std::memory_order_release);
+
+ fprintf(stderr, "Writing frames to shared memory %s\n", SHMNAME);
+ output.ring = ring;
+ return true;
+}
+
+bool writeFrame(Output &output, const uint8_t *data) {
+ if(output.mode == OUTPUTH264)
+  return encodeFrame(output.encoder, data);
+ else if(output.mode != OUTPUTSHM)
+  return fwrite(data, output.frameSize, 1, output.pipe) == 1;
+
+ ShmRing *ring = output.ring;
+ uint32_t sequence = ring->sequence.load(std::memory_order_relaxed) + 1;
+ if(!sequence)
+  sequence = 1;
+
+ ShmSlot &slot = ring->slots[sequence % NBSHMSLOTS];         // Écrase toujours l'image la plus ancienne
+ slot.sequence.store(0, std::memory_order_relaxed);
+ std::atomic_thread_fence(std::memory_order_release);
+
+ memcpy(ringFrame(ring, sequence), data, output.frameSize);
+ slot.timestamp = getTimeNs(CLOCK_MONOTONIC);
+
+ slot.sequence.store(sequence, std::memory_order_release);
+ ring->sequence.store(sequence, std::memory_order_release);
+ wakeRing(ring);
+ return true;
+}
+
+void closeOutput(Output &output) {
+ if(output.mode == OUTPUTH264)
+  closeEncoder(output.encoder);
+ else if(output.mode == OUTPUTSHM) {
+  munmap(output.ring, SHMDATAOFFSET + size_t(output.frameSize) * NBSHMSLOTS);
+  shm_unlink(SHMNAME);
+ } else
+  fflush(output.pipe);
+}
@@ -0,0 +1,48 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include "encoder.hpp"
+
+#define SHMNAME "/vigiclient-frames"
+#define SHMMAGIC 0x4d485356 // "VSHM"
+#define SHMDATAOFFSET 4096
+#define NBSHMSLOTS 4
+
+enum {
+ OUTPUTPIPE,
+ OUTPUTSHM,
+ OUTPUTH264
+};
+
+typedef struct ShmSlot {
+ std::atomic<uint32_t> sequence;                             // Numéro de l'image, 0 pendant l'écriture
+ uint32_t reserved;
+ uint64_t timestamp;
+} ShmSlot;
+
+typedef struct ShmRing {
+ std::atomic<uint32_t> magic;
+ uint32_t frameSize;
+ uint16_t width;
+ uint16_t height;
+ uint16_t fps;
+ bool yuv;                                                   // YUV 4:2:0 planaire, sinon BGR
+ std::atomic<uint32_t> sequence;                             // Dernière image publiée, sert aussi de futex
+ ShmSlot slots[NBSHMSLOTS];
+} ShmRing;
+
+typedef struct Output {
+ int mode;
+ FILE *pipe;
+ ShmRing *ring;
+ Encoder encoder;
+ int frameSize;
+} Output;
+
+bool openOutput(Output &output, int mode, FILE *pipe, const EncoderSettings &settings, int width, int height, int fps, bool yuv);
+bool writeFrame(Output &output, const uint8_t *data);
+void closeOutput(Output &output);
+ShmRing *mapRing(bool create, size_t size);
+uint8_t *ringFrame(ShmRing *ring, uint32_t sequence);
+void wakeRing(ShmRing *ring);
+bool waitRing(ShmRing *ring, uint32_t sequence, int timeout);
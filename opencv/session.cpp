@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <mutex>
+#include "common.hpp"
+#include "session.hpp"
+
+static FILE *recorder = NULL;
+static std::mutex recorderMutex;
+static uint64_t recorderStart;
+
+bool openRecorder(const char *path) {
+ FILE *file = fopen(path, "wb");
+ if(file == NULL) {
+  fprintf(stderr, "Error opening session file %s\n", path);
+  return false;
+ }
+
+ SessionHeader header = {SESSIONMAGIC, SESSIONVERSION};
+ fwrite(&header, sizeof(header), 1, file);
+
+ recorderStart = getTimeNs(CLOCK_MONOTONIC);
+ recorder = file;
+
+ fprintf(stderr, "Recording session to %s\n", path);
+ return true;
+}
+
+bool recording() {
+ return recorder != NULL;
+}
+
+void recordSession(uint8_t type, const void *data1, uint32_t size1, const void *data2, uint32_t size2) {
+ static const uint8_t padding[SESSIONALIGN] = {0};
+
+ if(recorder == NULL)
+  return;
+
+ SessionRecord record = {};
+ record.timestamp = getTimeNs(CLOCK_MONOTONIC) - recorderStart;
+ record.size = size1 + size2;
+ record.type = type;
+
+ std::lock_guard<std::mutex> lock(recorderMutex);
+ fwrite(&record, sizeof(record), 1, recorder);
+ fwrite(data1, size1, 1, recorder);
+ if(size2)
+  fwrite(data2, size2, 1, recorder);
+ fwrite(padding, -record.size & (SESSIONALIGN - 1), 1, recorder);
+}
+
+void closeRecorder() {
+ std::lock_guard<std::mutex> lock(recorderMutex);
+
+ if(recorder != NULL) {
+  fclose(recorder);
+  recorder = NULL;
+ }
+}
+
+bool replaySession(const char *path, bool fast, SessionCallback callback) {
+ int file = open(path, O_RDONLY);
+ if(file == -1) {
+  fprintf(stderr, "Error opening session file %s\n", path);
+  return false;
+ }
+
+ struct stat st;
+ fstat(file, &st);
+ size_t size = st.st_size;
+
+ if(size < sizeof(SessionHeader)) {
+  fprintf(stderr, "Session file %s is too short\n", path);
+  close(file);
+  return false;
+ }
+
+ uint8_t *data = (uint8_t *) mmap(NULL, size, PROT_READ, MAP_PRIVATE, file, 0);
+ close(file);
+ if(data == MAP_FAILED) {
+  fprintf(stderr, "Error mapping session file %s\n", path);
+  return false;
+ }
+ madvise(data, size, MADV_SEQUENTIAL);
+
+ SessionHeader *header = (SessionHeader *) data;
+ if(header->magic != SESSIONMAGIC || header->version != SESSIONVERSION) {
+  fprintf(stderr, "Session file %s has a bad header\n", path);
+  munmap(data, size);
+  return false;
+ }
+
+ fprintf(stderr, "Replaying session %s %s\n", path, fast ? "as fast as possible" : "in real time");
+
+ uint64_t start = getTimeNs(CLOCK_MONOTONIC);
+ size_t pos = sizeof(SessionHeader);
+ int n = 0;
+
+ while(pos + sizeof(SessionRecord) <= size) {
+  SessionRecord *record = (SessionRecord *) (data + pos);
+  pos += sizeof(SessionRecord);
+
+  if(pos + record->size > size) {                            // Enregistrement tronqué
+   fprintf(stderr, "Session file %s is truncated\n", path);
+   break;
+  }
+
+  if(!fast) {
+   uint64_t target = start + record->timestamp;
+   struct timespec ts = {time_t(target / 1000000000), long(target % 1000000000)};
+   while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL));
+  }
+
+  if(!callback(record->type, data + pos, record->size))
+   break;
+
+  pos += (record->size + SESSIONALIGN - 1) & ~(SESSIONALIGN - 1);
+  n++;
+ }
+
+ fprintf(stderr, "Replayed %d records in %d ms\n", n, int((getTimeNs(CLOCK_MONOTONIC) - start) / 1000000));
+
+ callback(SESSIONEND, NULL, 0);
+ munmap(data, size);
+ return true;
+}
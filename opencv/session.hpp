@@ -0,0 +1,38 @@
+#include <stdint.h>
+
+#define SESSIONMAGIC 0x53474956 // "VIGS"
+#define SESSIONVERSION 1
+#define SESSIONALIGN 8
+
+enum {
+ SESSIONLIDAR,                                               // Octets bruts du lidar
+ SESSIONIMU,                                                 // Pose de fusion de l'IMU (3 float)
+ SESSIONREMOTE,                                              // RemoteFrame complète
+ SESSIONCAMERA,                                              // SessionCamera suivie de l'image BGR
+ SESSIONEND                                                  // Fin du rejeu, les données précédentes ne sont plus accessibles
+};
+
+typedef struct SessionHeader {
+ uint32_t magic;
+ uint32_t version;
+} SessionHeader;
+
+typedef struct SessionRecord {
+ uint64_t timestamp;                                         // Nanosecondes depuis le début de l'enregistrement
+ uint32_t size;
+ uint8_t type;
+ uint8_t reserved[3];
+} SessionRecord;
+
+typedef struct SessionCamera {
+ uint16_t width;
+ uint16_t height;
+} SessionCamera;
+
+typedef bool (*SessionCallback)(uint8_t type, const uint8_t *data, uint32_t size);
+
+bool openRecorder(const char *path);
+bool recording();
+void recordSession(uint8_t type, const void *data1, uint32_t size1, const void *data2, uint32_t size2);
+void closeRecorder();
+bool replaySession(const char *path, bool fast, SessionCallback callback);
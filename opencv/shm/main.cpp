@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <vector>
+#include "../common.hpp"
+#include "../output.hpp"
+#include "main.hpp"
+
+using namespace std;
+
+void signal_callback_handler(int signum) {
+ fprintf(stderr, "Caught signal %d\n", signum);
+ run = false;
+}
+
+bool producerAlive() {
+ struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};              // Le producteur ne nous écrit rien, seule la fin du tube compte
+
+ if(poll(&pfd, 1, 0) == 1 && pfd.revents & (POLLHUP | POLLERR))
+  return false;
+
+ return true;
+}
+
+int main(int argc, char* argv[]) {
+ fprintf(stderr, "Starting\n");
+
+ signal(SIGTERM, signal_callback_handler);
+ signal(SIGPIPE, signal_callback_handler);
+
+ EncoderSettings encoderSettings = {0, ENCODERBITRATE, ENCODERKEYFRAMES};
+ bool encode = false;
+ int opt;
+
+ while((opt = getopt(argc, argv, "e:b:g:")) != -1) {
+  switch(opt) {
+   case 'e':
+    encode = true;
+    sscanf(optarg, "%d", &encoderSettings.port);
+    break;
+   case 'b':
+    sscanf(optarg, "%d", &encoderSettings.bitrate);
+    break;
+   case 'g':
+    sscanf(optarg, "%d", &encoderSettings.keyframes);
+    break;
+   default:
+    fprintf(stderr, "Usage: %s [-e port [-b bitrate] [-g keyframes]]\n", argv[0]);
+    return 1;
+  }
+ }
+
+ ShmRing *ring = NULL;
+ while(run && producerAlive()) {
+  ring = mapRing(false, 0);
+  if(ring != NULL)
+   break;
+  usleep(SHMOPENRETRY * 1000);
+ }
+
+ if(ring == NULL) {
+  fprintf(stderr, "Error opening shared memory %s\n", SHMNAME);
+  return 1;
+ }
+
+ fprintf(stderr, "Reading %dx%d frames from shared memory %s\n", ring->width, ring->height, SHMNAME);
+
+ Encoder encoder;                                            // Encodage direct depuis l'emplacement, sans tube vers ffmpeg
+ vector<uint8_t> frame;
+ if(encode) {
+  if(!openEncoder(encoder, encoderSettings, ring->width, ring->height, ring->fps, ring->yuv))
+   return 1;
+ } else
+  frame.resize(ring->frameSize);
+
+ uint32_t last = ring->sequence.load(memory_order_acquire);
+ uint64_t start = getTimeNs(CLOCK_MONOTONIC);
+ uint32_t frames = 0;
+ uint32_t skipped = 0;
+ uint32_t torn = 0;
+ uint64_t latency = 0;
+
+ while(run) {
+  if(!waitRing(ring, last, SHMWAITTIMEOUT)) {
+   if(!producerAlive())
+    break;
+   continue;
+  }
+
+  uint32_t sequence = ring->sequence.load(memory_order_acquire);
+  ShmSlot &slot = ring->slots[sequence % NBSHMSLOTS];
+
+  if(slot.sequence.load(memory_order_acquire) != sequence) { // Déjà en cours de réécriture
+   torn++;
+   last = sequence;
+   continue;
+  }
+
+  if(encode) {
+   if(!loadFrame(encoder, ringFrame(ring, sequence)))
+    break;
+  } else
+   memcpy(frame.data(), ringFrame(ring, sequence), frame.size());
+  uint64_t timestamp = slot.timestamp;
+
+  atomic_thread_fence(memory_order_acquire);
+  if(slot.sequence.load(memory_order_relaxed) != sequence) { // Réécrite pendant la copie
+   torn++;
+   last = sequence;
+   continue;
+  }
+
+  skipped += sequence - last - 1;                            // Images écrasées avant qu'on ait pu les lire
+  last = sequence;
+
+  if(encode) {
+   if(!sendFrame(encoder))
+    break;
+  } else if(fwrite(frame.data(), frame.size(), 1, stdout) != 1)
+   break;
+
+  frames++;
+  latency += getTimeNs(CLOCK_MONOTONIC) - timestamp;
+
+  uint64_t now = getTimeNs(CLOCK_MONOTONIC);
+  if(now - start >= SHMSTATSPERIOD * 1000000000ULL) {
+   fprintf(stderr, "Shared memory %u frames %u skipped %u torn %llu us average latency\n",
+                   frames, skipped, torn, (unsigned long long) (latency / 1000 / frames));
+   start = now;
+   frames = 0;
+   skipped = 0;
+   torn = 0;
+   latency = 0;
+  }
+ }
+
+ if(encode)
+  closeEncoder(encoder);
+
+ fprintf(stderr, "Stopping\n");
+ return 0;
+}
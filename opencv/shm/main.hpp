@@ -0,0 +1,5 @@
+#define SHMWAITTIMEOUT 100
+#define SHMOPENRETRY 100
+#define SHMSTATSPERIOD 10
+
+volatile bool run = true;